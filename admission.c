@@ -0,0 +1,127 @@
+/*
+ * Admission control and load shedding.
+ *
+ * Two limits protect the server from overload: the number of open
+ * client connections, and the number of transactions being processed.
+ * Work above a limit is refused immediately with a pre-rendered
+ * 503 Service Unavailable response carrying Retry-After, and the
+ * connection is closed.  Refusing costs one counter update and one
+ * non-blocking send, so the accept path stays O(1) while shedding.
+ *
+ * Anonymous traffic may only use part of the in-flight budget; the
+ * rest is reserved for authenticated requests, which therefore keep
+ * being served while anonymous static traffic is being shed.
+ *
+ * A limit of 0 means unlimited.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "bufio.h"
+#include "admission.h"
+
+#define RETRY_AFTER_SECONDS 1
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+static const char unavailable_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Server: CS3214-Personal-Server\r\n"
+    "Retry-After: " XSTR(RETRY_AFTER_SECONDS) "\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+static int max_conns;
+static int max_txns;
+static int max_anon_txns;       // the share of max_txns anonymous requests may use
+static atomic_int open_conns;
+static atomic_int inflight_txns;
+
+/**
+ * Set the limits.  Must be called before clients are accepted.
+ * @param max_connections The maximum number of open connections, 0 for no limit
+ * @param max_inflight The maximum number of concurrent transactions, 0 for no limit
+ */
+void admission_init(int max_connections, int max_inflight)
+{
+    max_conns = max_connections;
+    max_txns = max_inflight;
+    // reserve a quarter of the budget for authenticated traffic
+    max_anon_txns = max_inflight - max_inflight / 4;
+    if (max_inflight > 0 && max_anon_txns == 0)
+        max_anon_txns = 1;
+}
+
+/**
+ * Account for a newly accepted client.  If the connection limit is
+ * reached, the client is sent a 503 response and its socket is closed.
+ * @param client_socket The accepted socket
+ * @return return true if the client was admitted; it must then be
+ *         released with admission_conn_close
+ */
+bool admission_conn_open(int client_socket)
+{
+    int n = atomic_fetch_add(&open_conns, 1);
+    if (max_conns == 0 || n < max_conns)
+    {
+        return true;
+    }
+    atomic_fetch_sub(&open_conns, 1);
+
+    // best effort; a client whose socket buffer is full gets just the close
+    send(client_socket, unavailable_response, sizeof(unavailable_response) - 1,
+         MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_socket);
+    return false;
+}
+
+/* Release a connection admitted by admission_conn_open. */
+void admission_conn_close(void)
+{
+    atomic_fetch_sub(&open_conns, 1);
+}
+
+/**
+ * Admit a transaction.
+ * @param priority Whether the request is authenticated traffic
+ * @return return true if the transaction may proceed; it must then be
+ *         released with admission_txn_end.  If false, the caller should
+ *         answer with admission_send_unavailable.
+ */
+bool admission_txn_begin(bool priority)
+{
+    int n = atomic_fetch_add(&inflight_txns, 1);
+    if (max_txns == 0 || n < (priority ? max_txns : max_anon_txns))
+    {
+        return true;
+    }
+    atomic_fetch_sub(&inflight_txns, 1);
+    return false;
+}
+
+/* Release a transaction admitted by admission_txn_begin. */
+void admission_txn_end(void)
+{
+    atomic_fetch_sub(&inflight_txns, 1);
+}
+
+/**
+ * Send the pre-rendered 503 response on a client connection.
+ * The response asks the client to close the connection.
+ * @return return true if the response was sent
+ */
+bool admission_send_unavailable(struct bufio *bufio)
+{
+    buffer_t resp = {
+        .buf = (char *)unavailable_response,
+        .len = sizeof(unavailable_response) - 1,
+        .cap = sizeof(unavailable_response)
+    };
+    return bufio_sendbuffer(bufio, &resp) != -1;
+}
@@ -0,0 +1,15 @@
+#ifndef _ADMISSION_H
+#define _ADMISSION_H
+
+#include <stdbool.h>
+
+struct bufio;
+
+void admission_init(int max_connections, int max_inflight);
+bool admission_conn_open(int client_socket);
+void admission_conn_close(void);
+bool admission_txn_begin(bool priority);
+void admission_txn_end(void);
+bool admission_send_unavailable(struct bufio *bufio);
+
+#endif /* _ADMISSION_H */
@@ -0,0 +1,96 @@
+/*
+ * Bump-pointer arena.
+ *
+ * Memory is handed out from chunks by advancing a pointer; individual
+ * objects are never freed.  Resetting the arena returns all overflow
+ * chunks to the buffer pool and rewinds the first one, so an arena that
+ * is reset between the requests of a keep-alive connection settles on
+ * a single chunk and allocates without touching malloc at all.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "bufpool.h"
+
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;                    // usable size as reported by the pool
+    max_align_t data[];
+};
+
+/* Prepare an empty arena. */
+void arena_init(struct arena *a)
+{
+    a->chunks = NULL;
+    a->ptr = a->end = NULL;
+}
+
+/* Start a new chunk that can hold at least 'size' bytes. */
+static void arena_grow(struct arena *a, size_t size)
+{
+    size_t want = sizeof(struct arena_chunk) + (size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+    size_t cap;
+    struct arena_chunk *c = bufpool_alloc(want, &cap);
+    if (c == NULL)
+    {
+        perror("can't alloc memory: ");
+        exit(EXIT_FAILURE);
+    }
+    c->size = cap;
+    c->next = a->chunks;
+    a->chunks = c;
+    a->ptr = (char *)c->data;
+    a->end = (char *)c + cap;
+}
+
+/**
+ * Allocate memory that lives until the arena is reset or destroyed.
+ * @param a The arena
+ * @param size The number of bytes needed
+ * @return suitably aligned memory; exits the process if none is left
+ */
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if ((size_t)(a->end - a->ptr) < size)
+        arena_grow(a, size);
+    void *p = a->ptr;
+    a->ptr += size;
+    return p;
+}
+
+/* Copy a string into the arena. */
+char *arena_strdup(struct arena *a, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(a, len), s, len);
+}
+
+/* Free everything allocated from the arena, keeping its first chunk. */
+void arena_reset(struct arena *a)
+{
+    if (a->chunks == NULL)
+        return;
+    while (a->chunks->next != NULL)
+    {
+        struct arena_chunk *c = a->chunks;
+        a->chunks = c->next;
+        bufpool_free(c, c->size);
+    }
+    a->ptr = (char *)a->chunks->data;
+    a->end = (char *)a->chunks + a->chunks->size;
+}
+
+/* Free everything allocated from the arena and its storage. */
+void arena_destroy(struct arena *a)
+{
+    arena_reset(a);
+    if (a->chunks != NULL)
+        bufpool_free(a->chunks, a->chunks->size);
+    arena_init(a);
+}
@@ -0,0 +1,25 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/*
+ * A bump-pointer allocator for objects that all die together, such as
+ * the temporary allocations of one HTTP transaction.  A zeroed arena is
+ * valid and empty; its first chunk is allocated on first use.
+ */
+struct arena_chunk;
+
+struct arena {
+    struct arena_chunk *chunks;     // most recent first; the last one is kept on reset
+    char *ptr;                      // next free byte in the current chunk
+    char *end;                      // end of the current chunk
+};
+
+void arena_init(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strdup(struct arena *a, const char *s);
+void arena_reset(struct arena *a);
+void arena_destroy(struct arena *a);
+
+#endif /* _ARENA_H */
@@ -18,10 +18,17 @@
  *
  * The buffer is not thread-safe.
  * This buffer handles out-of-memory situations by exiting the process.
+ *
+ * Storage comes from the thread-local pool in bufpool.c, so a buffer's
+ * capacity is rounded up to the pool's size class, and buffers of
+ * transactions on a keep-alive connection are recycled rather than
+ * going through malloc and free each time.
  */
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include "bufpool.h"
 
 typedef struct
 {
@@ -35,10 +42,11 @@ typedef struct
  */
 static inline void buffer_init(buffer_t *buf, int initialsize)
 {
+    size_t cap;
     buf->len = 0;
-    buf->cap = initialsize;
-    buf->buf = malloc(buf->cap);
-    if (buf->buf == NULL)
+    buf->buf = bufpool_alloc(initialsize, &cap);
+    buf->cap = cap;
+    if (buf->buf == NULL && initialsize > 0)
     {
         perror("can't alloc memory: ");
         exit(EXIT_FAILURE);
@@ -51,17 +59,18 @@ static inline void buffer_reset(buffer_t *buf, int size)
     buf->len = 0;
     if (buf->cap > size)
     {
-        buf->buf = realloc(buf->buf, size);
-        buf->cap = size;
+        size_t cap;
+        buf->buf = bufpool_realloc(buf->buf, 0, buf->cap, size, &cap);
+        buf->cap = cap;
     }
 }
 
 /* Delete this buffer, freeing any storage. */
 static inline void buffer_delete(buffer_t *buf)
 {
+    bufpool_free(buf->buf, buf->cap);
     buf->len = 0;
     buf->cap = 0;
-    free(buf->buf);
     buf->buf = NULL;
 }
 
@@ -80,8 +89,8 @@ static inline char *buffer_ensure_capacity(buffer_t *buf, int len)
 {
     if (buf->len + len >= buf->cap)
     {
-        int cap = buf->cap * 2 + len;
-        buf->buf = realloc(buf->buf, cap);
+        size_t cap;
+        buf->buf = bufpool_realloc(buf->buf, buf->len, buf->cap, buf->cap * 2 + len, &cap);
         if (buf->buf == NULL)
         {
             perror("can't alloc memory: ");
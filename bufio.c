@@ -7,11 +7,23 @@
  * Since it encapsulates a connection's socket, it also provides
  * methods for sending data.
  *
+ * By default, sending blocks until everything has been sent.  A bufio
+ * used by the event loop instead queues whatever the socket does not
+ * accept right away (see bufio_queue_output), and the loop drains the
+ * queue with bufio_flush as the socket becomes writable.
+ *
+ * Output can also be corked (bufio_cork): everything sent is queued
+ * until bufio_uncork, which sends all of it with as few gather writes
+ * as possible.  This batches the responses to pipelined requests.
+ *
  * Written by G. Back for CS 3214 Spring 2018
  */
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
+#include <poll.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <errno.h>
@@ -22,23 +34,531 @@
 #include <assert.h>
 
 #include "bufio.h"
+#ifdef HAVE_IO_URING
+#include <fcntl.h>
+#include "uring.h"
+#endif
 
 /*****************************************************************/
+/* Output that could not be sent yet: a copy of some bytes, or a range
+ * of a file. */
+struct outseg
+{
+    struct outseg *next;
+    int fd;             // file to send from, or -1 for bytes in data[]
+    off_t off;          // position in the file, or offset into data[]
+    size_t len;         // bytes left to send
+    size_t size;        // size of this allocation
+    char data[];
+};
+
 struct bufio
 {
     int socket;         // underlying socket file descriptor
     size_t bufpos;      // offset of next byte to be read
     buffer_t buf;       // holds data that was received
+    int capacity;       // fixed size of buf, or 0 if it grows as needed
+    bool queue_output;  // queue output the socket won't take instead of blocking
+    bool corked;        // queue all output until bufio_uncork
+    struct outseg *outq, *outq_tail;    // queued output, oldest first
+    size_t outq_bytes;  // bytes left in the queue
+#ifdef HAVE_IO_URING
+    struct uring_ctx *uring;    // NULL unless the io_uring backend is enabled
+    buffer_t staged;    // data to send with the next submission
+#endif
 };
 
 static const int BUFSIZE = 8192;
 static const int READSIZE = 2048;
+/* File ranges up to this size are copied into the output queue, so
+ * that they can be gathered with the surrounding output. */
+static const size_t INLINE_FILE_MAX = 16384;
+/* Maximum number of queued segments sent with one gather write. */
+enum { FLUSH_IOV_MAX = 64 };
 static int min(int a, int b) { return a < b ? a : b; }
 
+/* Make room for up to 'want' more received bytes at the end of the
+ * buffer.  A growable buffer always makes room for all of them; a
+ * fixed-capacity one only has what is left, which may be nothing.
+ * Returns the number of bytes that fit.
+ */
+static int reserve(struct bufio *self, int want)
+{
+    if (self->capacity == 0)
+    {
+        buffer_ensure_capacity(&self->buf, want);
+        return want;
+    }
+    return min(want, self->capacity - self->buf.len);
+}
+
+/* Block until the socket can take more data.  Sockets owned by the
+ * event loop are non-blocking, so a full send buffer shows up as
+ * EAGAIN rather than as a blocking send.
+ */
+static int wait_writable(int socket)
+{
+    struct pollfd pfd = { .fd = socket, .events = POLLOUT };
+    int rc;
+    do {
+        rc = poll(&pfd, 1, -1);
+    } while (rc == -1 && errno == EINTR);
+    return rc == -1 ? -1 : 0;
+}
+
+/* Send buf[0:len] to 'socket', retrying until all of it has been sent.
+ * Returns the number of bytes sent, or -1 on error.
+ */
+static ssize_t send_all(int socket, char *buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t rc = send(socket, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && wait_writable(socket) == 0)
+                continue;
+            return -1;
+        }
+        sent += rc;
+    }
+    return sent;
+}
+
+/* Send as much of 'msg' as possible, advancing its iovecs past what
+ * was sent.  Waits for the socket to become writable as needed, unless
+ * output is queued, in which case it stops once the socket's send buffer
+ * is full.
+ * Returns the number of bytes sent, or -1 on error.
+ */
+static ssize_t send_msg(struct bufio *self, struct msghdr *msg, int flags)
+{
+    ssize_t sent = 0;
+    while (msg->msg_iovlen > 0) {
+        ssize_t rc = sendmsg(self->socket, msg, flags);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && self->queue_output)
+                break;
+            if (errno == EAGAIN && wait_writable(self->socket) == 0)
+                continue;
+            return -1;
+        }
+        sent += rc;
+        // skip the iovecs that were sent completely, then trim the first one left
+        while (msg->msg_iovlen > 0 && (size_t) rc >= msg->msg_iov->iov_len) {
+            rc -= msg->msg_iov->iov_len;
+            msg->msg_iov++;
+            msg->msg_iovlen--;
+        }
+        if (msg->msg_iovlen > 0) {
+            msg->msg_iov->iov_base = (char *) msg->msg_iov->iov_base + rc;
+            msg->msg_iov->iov_len -= rc;
+        }
+    }
+    return sent;
+}
+
+/* Send up to 'count' bytes of a file, like send_msg.  Sets *eof if the
+ * file ended early.
+ * Returns the number of bytes sent, or -1 on error.
+ */
+static ssize_t send_file(struct bufio *self, int fd, off_t *off, size_t count, bool *eof)
+{
+    size_t sent = 0;
+    *eof = false;
+    while (sent < count) {
+        ssize_t rc = sendfile(self->socket, fd, off, count - sent);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && self->queue_output)
+                break;
+            if (errno == EAGAIN && wait_writable(self->socket) == 0)
+                continue;
+            return -1;
+        }
+        if (rc == 0) {
+            *eof = true;
+            break;
+        }
+        sent += rc;
+    }
+    return sent;
+}
+
+static void outq_append(struct bufio *self, struct outseg *seg)
+{
+    seg->next = NULL;
+    if (self->outq_tail != NULL)
+        self->outq_tail->next = seg;
+    else
+        self->outq = seg;
+    self->outq_tail = seg;
+    self->outq_bytes += seg->len;
+}
+
+/* Queue a copy of the bytes described by iov[0:iovcnt]. */
+static void outq_append_iov(struct bufio *self, struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    size_t size;
+    struct outseg *seg = bufpool_alloc(sizeof(*seg) + len, &size);
+    if (seg == NULL) {
+        perror("can't alloc memory: ");
+        exit(EXIT_FAILURE);
+    }
+    seg->fd = -1;
+    seg->off = 0;
+    seg->len = 0;
+    seg->size = size;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(seg->data + seg->len, iov[i].iov_base, iov[i].iov_len);
+        seg->len += iov[i].iov_len;
+    }
+    outq_append(self, seg);
+}
+
+/* Queue a range of a file.  A small range is read into the queue;
+ * otherwise the queue keeps its own descriptor.  Either way, the
+ * caller may close 'fd'.
+ * Returns the number of bytes queued, which is less than 'len' if the
+ * file ends early, or -1 on error. */
+static ssize_t outq_append_file(struct bufio *self, int fd, off_t off, size_t len)
+{
+    bool inline_data = len <= INLINE_FILE_MAX;
+    size_t size;
+    struct outseg *seg = bufpool_alloc(sizeof(*seg) + (inline_data ? len : 0), &size);
+    if (seg == NULL) {
+        perror("can't alloc memory: ");
+        exit(EXIT_FAILURE);
+    }
+    seg->size = size;
+    if (inline_data) {
+        ssize_t rc = pread(fd, seg->data, len, off);
+        if (rc == -1) {
+            bufpool_free(seg, size);
+            return -1;
+        }
+        seg->fd = -1;
+        seg->off = 0;
+        seg->len = rc;
+    } else {
+        seg->fd = dup(fd);
+        if (seg->fd == -1) {
+            bufpool_free(seg, size);
+            return -1;
+        }
+        seg->off = off;
+        seg->len = len;
+    }
+    outq_append(self, seg);
+    return seg->len;
+}
+
+static void outq_pop(struct bufio *self)
+{
+    struct outseg *seg = self->outq;
+    self->outq = seg->next;
+    if (self->outq == NULL)
+        self->outq_tail = NULL;
+    self->outq_bytes -= seg->len;
+    if (seg->fd != -1)
+        close(seg->fd);
+    bufpool_free(seg, seg->size);
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring backend.
+ *
+ * Each thread serving connections owns a ring, a group of provided
+ * buffers and a pipe.  Sends are not issued right away; their data is
+ * staged and submitted together with the next operation that has to
+ * wait anyway, so a response and the recv of the next request cost
+ * a single io_uring_enter.  A file is sent as a linked chain:
+ * staged send -> splice(file, pipe) -> splice(pipe, socket).
+ * Recvs use provided buffers, so no receive buffer has to be set aside
+ * while the submission is in flight.
+ */
+struct uring_ctx
+{
+    struct uring ring;
+    int pipefd[2];      // for splicing file data to the socket
+    int pipesize;
+};
+
+static __thread struct uring_ctx *thread_uring;
+
+enum { URING_ENTRIES = 64, URING_NBUFS = 8, URING_BUFSIZE = 16384, URING_BGID = 0 };
+
+/* At most one send, two splices and a recv are in flight per batch. */
+struct uring_batch
+{
+    int n;
+    int res[4];
+    unsigned flags[4];
+};
+
+static struct uring_ctx * thread_uring_get(void)
+{
+    if (thread_uring != NULL)
+        return thread_uring;
+
+    struct uring_ctx *ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+        return NULL;
+    if (uring_init(&ctx->ring, URING_ENTRIES) == -1)
+        goto fail;
+    if (uring_setup_buffers(&ctx->ring, URING_BGID, URING_NBUFS, URING_BUFSIZE) == -1)
+        goto fail_ring;
+    if (pipe2(ctx->pipefd, O_CLOEXEC) == -1)
+        goto fail_ring;
+    fcntl(ctx->pipefd[1], F_SETPIPE_SZ, 1 << 20);
+    ctx->pipesize = fcntl(ctx->pipefd[1], F_GETPIPE_SZ);
+    if (ctx->pipesize <= 0)
+        ctx->pipesize = 65536;
+    thread_uring = ctx;
+    return ctx;
+
+fail_ring:
+    uring_exit(&ctx->ring);
+fail:
+    perror("io_uring");
+    free(ctx);
+    return NULL;
+}
+
+/* Switch this bufio to the calling thread's io_uring.
+ * Returns false (leaving the bufio on plain system calls) if the
+ * ring cannot be set up.
+ */
+bool bufio_enable_uring(struct bufio *self)
+{
+    self->uring = thread_uring_get();
+    if (self->uring == NULL)
+        return false;
+    buffer_init(&self->staged, 1024);
+    return true;
+}
+
+static struct io_uring_sqe * batch_sqe(struct bufio *self, struct uring_batch *b, int opcode, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&self->uring->ring);
+    assert(sqe != NULL);     // the ring is only used synchronously by its thread
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = b->n++;
+    return sqe;
+}
+
+static int staged_done(struct bufio *self, struct uring_batch *b, int idx);
+
+/* Submit the batch with one system call and wait for all of it.  The
+ * staged send at 'send_idx', if any, is finished as soon as it completes:
+ * the peer may not send what a recv in the same batch waits for before
+ * it has the whole response. */
+static int batch_run(struct bufio *self, struct uring_batch *b, int send_idx)
+{
+    struct uring *ring = &self->uring->ring;
+    int done = 0, rc = 0;
+    if (uring_submit_and_wait(ring, send_idx != -1 ? 1 : b->n) == -1)
+        return -1;
+    while (done < b->n)
+    {
+        struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+        if (cqe == NULL)
+        {
+            if (uring_submit_and_wait(ring, 1) == -1)
+                return -1;
+            continue;
+        }
+        int idx = cqe->user_data;
+        b->res[idx] = cqe->res;
+        b->flags[idx] = cqe->flags;
+        uring_cqe_seen(ring);
+        done++;
+        if (idx == send_idx && staged_done(self, b, idx) == -1)
+            rc = -1;        // keep reaping the rest of the batch
+    }
+    return rc;
+}
+
+/* Add a send of the staged data to the batch.  Returns its index, or
+ * -1 if nothing is staged. */
+static int batch_staged(struct bufio *self, struct uring_batch *b, bool link)
+{
+    if (self->staged.len == 0)
+        return -1;
+    int idx = b->n;
+    struct io_uring_sqe *sqe = batch_sqe(self, b, IORING_OP_SEND, self->socket);
+    sqe->addr = (unsigned long)self->staged.buf;
+    sqe->len = self->staged.len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    if (link)
+        sqe->flags |= IOSQE_IO_LINK;
+    return idx;
+}
+
+/* Account for the completion of the staged send, finishing a short
+ * send synchronously, on kernels that do not honour MSG_WAITALL for
+ * sends.  Returns -1 if the send failed. */
+static int staged_done(struct bufio *self, struct uring_batch *b, int idx)
+{
+    if (idx == -1)
+        return 0;
+    int res = b->res[idx];
+    int len = self->staged.len;
+    self->staged.len = 0;
+    if (res < 0)
+    {
+        errno = -res;
+        return -1;
+    }
+    if (res < len && send_all(self->socket, self->staged.buf + res, len - res) == -1)
+        return -1;
+    return 0;
+}
+
+/* Submit any staged data on its own. */
+static int uring_flush(struct bufio *self)
+{
+    struct uring_batch b = { 0 };
+    int idx = batch_staged(self, &b, false);
+    if (idx == -1)
+        return 0;
+    return batch_run(self, &b, idx);
+}
+
+/* Receive into a provided buffer, submitting staged sends along with
+ * the recv, and append what was received to the bufio buffer. */
+static ssize_t uring_read_more(struct bufio *self)
+{
+    struct uring *ring = &self->uring->ring;
+    struct uring_batch b = { 0 };
+    int send_idx = batch_staged(self, &b, false);
+    int room = reserve(self, ring->bufsize);
+    if (room == 0)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+    int recv_idx = b.n;
+    struct io_uring_sqe *sqe = batch_sqe(self, &b, IORING_OP_RECV, self->socket);
+    sqe->len = room;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ring->bgid;
+
+    if (batch_run(self, &b, send_idx) == -1)
+        return -1;
+
+    int res = b.res[recv_idx];
+    if (res < 0)
+    {
+        errno = -res;
+        return -1;
+    }
+    if (b.flags[recv_idx] & IORING_CQE_F_BUFFER)
+    {
+        unsigned bid = b.flags[recv_idx] >> IORING_CQE_BUFFER_SHIFT;
+        memcpy(self->buf.buf + self->buf.len, uring_buffer(ring, bid), res);
+        self->buf.len += res;
+        uring_recycle_buffer(ring, bid);
+    }
+    return res;
+}
+
+/* Move data left in the pipe by a short splice chain to the socket. */
+static int drain_pipe(struct bufio *self, size_t inpipe)
+{
+    while (inpipe > 0)
+    {
+        ssize_t rc = splice(self->uring->pipefd[0], NULL, self->socket, NULL, inpipe, SPLICE_F_MOVE);
+        if (rc <= 0)
+        {
+            if (rc == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        inpipe -= rc;
+    }
+    return 0;
+}
+
+/* Send staged data followed by a file as linked send/splice chains. */
+static ssize_t uring_sendfile(struct bufio *self, int fd, off_t *off, size_t filesize)
+{
+    off_t pos = off != NULL ? *off : 0;
+    ssize_t sent = 0;
+    while (sent < filesize || self->staged.len > 0)
+    {
+        struct uring_batch b = { 0 };
+        size_t left = filesize - sent;
+        int chunk = left < (size_t)self->uring->pipesize ? left : self->uring->pipesize;
+        int send_idx = batch_staged(self, &b, chunk > 0);
+        int in_idx = -1, out_idx = -1;
+        if (chunk > 0)
+        {
+            in_idx = b.n;
+            struct io_uring_sqe *sqe = batch_sqe(self, &b, IORING_OP_SPLICE, self->uring->pipefd[1]);
+            sqe->off = -1;
+            sqe->splice_fd_in = fd;
+            sqe->splice_off_in = pos;
+            sqe->len = chunk;
+            sqe->splice_flags = SPLICE_F_MOVE;
+            sqe->flags |= IOSQE_IO_LINK;
+
+            out_idx = b.n;
+            sqe = batch_sqe(self, &b, IORING_OP_SPLICE, self->socket);
+            sqe->off = -1;
+            sqe->splice_fd_in = self->uring->pipefd[0];
+            sqe->splice_off_in = -1;
+            sqe->len = chunk;
+            sqe->splice_flags = SPLICE_F_MOVE;
+        }
+
+        if (batch_run(self, &b, send_idx) == -1)
+            return -1;
+        if (chunk == 0)
+            break;
+
+        /* A short splice into the pipe cancels the rest of the chain. */
+        int in = b.res[in_idx], out = b.res[out_idx];
+        if (in < 0)
+        {
+            if (in == -ECANCELED)
+                continue;       // the send was short; retry this chunk
+            errno = -in;
+            return -1;
+        }
+        if (out < 0 && out != -ECANCELED)
+        {
+            errno = -out;
+            return -1;
+        }
+        if (out < in && drain_pipe(self, in - (out < 0 ? 0 : out)) == -1)
+            return -1;
+        if (in == 0)
+            break;      // file is shorter than expected
+        pos += in;
+        sent += in;
+    }
+    if (off != NULL)
+        *off = pos;
+    return sent;
+}
+#endif /* HAVE_IO_URING */
+
 /* Create a new bufio object from a socket. */
 struct bufio* bufio_create(int socket)
 {
-    struct bufio * rc = malloc(sizeof(*rc));
+    size_t cap;
+    struct bufio * rc = bufpool_alloc(sizeof(*rc), &cap);
     if (rc == NULL) {
         perror("malloc");
         exit(EXIT_FAILURE);
@@ -46,18 +566,53 @@ struct bufio* bufio_create(int socket)
 
     rc->bufpos = 0;
     rc->socket = socket;
+    rc->capacity = 0;
+    rc->queue_output = false;
+    rc->corked = false;
+    rc->outq = rc->outq_tail = NULL;
+    rc->outq_bytes = 0;
     buffer_init(&rc->buf, BUFSIZE);
+#ifdef HAVE_IO_URING
+    rc->uring = NULL;
+#endif
+    return rc;
+}
+
+/* Create a new bufio object whose buffer never grows beyond 'capacity'
+ * bytes, rounded up to a power of two.  Its storage is allocated once
+ * and reused for the connection's lifetime; bufio_truncate compacts
+ * it in place.  Reads that find it full fail with ENOBUFS, so this
+ * caps the size of a request line, headers and body.
+ */
+struct bufio* bufio_create_fixed(int socket, size_t capacity)
+{
+    struct bufio * rc = bufio_create(socket);
+    size_t cap = 1024;
+    while (cap < capacity)
+        cap *= 2;
+    buffer_delete(&rc->buf);
+    buffer_init(&rc->buf, cap);
+    rc->capacity = cap;
     return rc;
 }
 
 /* Close a bufio object, freeing its storage and closing its socket. */
 void bufio_close(struct bufio * self)
 {
+#ifdef HAVE_IO_URING
+    if (self->uring != NULL)
+    {
+        uring_flush(self);
+        buffer_delete(&self->staged);
+    }
+#endif
+    while (self->outq != NULL)
+        outq_pop(self);
     if (close(self->socket))
         perror("close");
 
     buffer_delete(&self->buf);
-    free(self);
+    bufpool_free(self, sizeof(*self));
 }
 
 static ssize_t bytes_buffered(struct bufio *self)
@@ -73,10 +628,23 @@ const int TRUNCATE_THRESHOLD = 10000;       // tune me
  *
  * This method is provided to avoid accumulating all data received
  * on a long-running HTTP/1.1 connection into a single buffer.
+ *
+ * A fixed-capacity buffer is always compacted, in place: unread bytes
+ * are moved to the front, nothing is allocated or freed.
  */
 void bufio_truncate(struct bufio * self)
 {
-    if (self->buf.len > TRUNCATE_THRESHOLD)
+    if (self->capacity != 0)
+    {
+        int unread = bytes_buffered(self);
+        if (unread > 0 && self->bufpos > 0)
+        {
+            memmove(self->buf.buf, self->buf.buf + self->bufpos, unread);
+        }
+        self->buf.len = unread;
+        self->bufpos = 0;
+    }
+    else if (self->buf.len > TRUNCATE_THRESHOLD)
     {
         int unread = bytes_buffered(self);
         assert(unread >= 0);
@@ -97,8 +665,19 @@ void bufio_truncate(struct bufio * self)
 
 static ssize_t read_more(struct bufio *self)
 {
-    char * buf = buffer_ensure_capacity(&self->buf, READSIZE);
-    int bread = recv(self->socket, buf, READSIZE, MSG_NOSIGNAL);
+#ifdef HAVE_IO_URING
+    if (self->uring != NULL)
+        return uring_read_more(self);
+#endif
+    // a fixed-capacity buffer is filled as far as it goes
+    int room = reserve(self, self->capacity != 0 ? self->capacity : READSIZE);
+    if (room == 0)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+    char * buf = self->buf.buf + self->buf.len;
+    int bread = recv(self->socket, buf, room, MSG_NOSIGNAL);
     if (bread < 1)
     {
         return bread;
@@ -107,6 +686,62 @@ static ssize_t read_more(struct bufio *self)
     return bread;
 }
 
+/* Read everything currently available on a non-blocking socket.
+ * Used by the event loop, which must drain the socket on each
+ * edge-triggered readiness notification.
+ *
+ * Returns the number of bytes read, 0 on EOF, and -1 on error.
+ * If no data was available, returns -1 with errno set to EAGAIN.
+ * A fixed-capacity buffer may fill up before the socket is drained;
+ * bufio_full tells whether that happened.
+ */
+ssize_t bufio_fill(struct bufio *self)
+{
+    ssize_t total = 0;
+    for (;;) {
+        ssize_t rc = read_more(self);
+        if (rc == 0)
+            return total > 0 ? total : 0;
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) && total > 0)
+                return total;
+            return -1;
+        }
+        total += rc;
+    }
+}
+
+/* Read more data from the socket into the buffer, blocking if necessary.
+ * Returns the number of bytes read, 0 on EOF, and -1 on error.
+ */
+ssize_t bufio_read_more(struct bufio *self)
+{
+    return read_more(self);
+}
+
+/* Return true if a fixed-capacity buffer has no room for more data. */
+bool bufio_full(struct bufio *self)
+{
+    return self->capacity != 0 && self->buf.len == self->capacity;
+}
+
+/* Return the socket this bufio reads from and writes to. */
+int bufio_socket(struct bufio *self)
+{
+    return self->socket;
+}
+
+/* Return a pointer to the buffered bytes that have not been read yet,
+ * and store their number in *len.  Nothing is consumed.
+ */
+char * bufio_unread(struct bufio *self, size_t *len)
+{
+    *len = bytes_buffered(self);
+    return self->buf.buf + self->bufpos;
+}
+
 /* Given an offset into the buffer, return a char *.
  * This pointer will be valid only until the next call
  * to any of the bufio_read* function.
@@ -160,13 +795,24 @@ ssize_t bufio_readbyte(struct bufio *self, char *out)
  *
  * If EOF is encountered, the line may not be terminated
  * with a \n.
+ *
+ * Each buffered span is searched with memchr(), which glibc
+ * implements with SSE2/AVX2 and selects at run time, instead of
+ * going through bufio_readbyte() for every character.
  */
 ssize_t bufio_readline(struct bufio *self, size_t *line_offset)
 {
     *line_offset = self->bufpos;
-    char p = 0;
-    while (p != '\n') {
-        int rc = bufio_readbyte(self, &p);
+    for (;;) {
+        char *start = self->buf.buf + self->bufpos;
+        char *nl = memchr(start, '\n', bytes_buffered(self));
+        if (nl != NULL) {
+            self->bufpos += nl - start + 1;
+            break;
+        }
+        self->bufpos = self->buf.len;
+
+        int rc = read_more(self);
         if (rc < 0)
             return rc;
         if (rc == 0)
@@ -196,19 +842,186 @@ ssize_t bufio_read(struct bufio *self, size_t count, size_t *buf_offset)
     return bytes_read;
 }
 
-/* Send a file out to the socket.
- * See sendfile(2) for return value.
+/* Send 'count' bytes of a file out to the socket, starting at *off,
+ * or at the file's current position if off is NULL.  Retries until
+ * all of it has been sent, the file ends, or an error occurs.  If
+ * output is queued, whatever the socket does not take right away is
+ * queued, and counts as sent.
+ * Returns the number of bytes sent, or -1 on error.
  */
-ssize_t bufio_sendfile(struct bufio *self, int fd, off_t *off, int filesize)
+ssize_t bufio_sendfile(struct bufio *self, int fd, off_t *off, size_t count)
 {
-    return sendfile(self->socket, fd, off, filesize);
+#ifdef HAVE_IO_URING
+    if (self->uring != NULL)
+        return uring_sendfile(self, fd, off, count);
+#endif
+    if (!self->queue_output && !self->corked)
+    {
+        bool eof;
+        return send_file(self, fd, off, count, &eof);
+    }
+
+    off_t pos = off != NULL ? *off : lseek(fd, 0, SEEK_CUR);
+    if (pos == -1)
+        return -1;
+    ssize_t sent = 0;
+    if (self->outq == NULL && !self->corked)
+    {
+        bool eof;
+        sent = send_file(self, fd, &pos, count, &eof);
+        if (sent == -1)
+            return -1;
+        if (eof)
+            count = sent;
+    }
+    if (sent < count)
+    {
+        ssize_t queued = outq_append_file(self, fd, pos, count - sent);
+        if (queued == -1)
+            return -1;
+        count = sent + queued;
+    }
+    pos += count - sent;
+    if (off != NULL)
+        *off = pos;
+    return count;
 }
 
 /*
- * Send data contained in 'resp' to the socket.
- * See send(2) for return value.
+ * Send the buffers described by iov[0:iovcnt] with one gather write,
+ * retrying after short writes until all of it has been sent or an
+ * error occurs.  The iovec array is updated to skip what was sent.
+ * If output is queued, whatever the socket does not take right away
+ * is copied into the queue, and counts as sent.  If output is corked,
+ * all of it is.
+ * If 'more' is true, the kernel is told that more data follows
+ * (MSG_MORE), so that it coalesces this data with what is sent next,
+ * e.g., response headers with the start of a file sent by
+ * bufio_sendfile, despite TCP_NODELAY.
+ * Returns the number of bytes sent, or -1 on error.
+ */
+ssize_t bufio_sendv(struct bufio *self, struct iovec *iov, int iovcnt, bool more)
+{
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+#ifdef HAVE_IO_URING
+    if (self->uring != NULL) {
+        // sent along with the next submission
+        for (int i = 0; i < iovcnt; i++)
+            buffer_append(&self->staged, iov[i].iov_base, iov[i].iov_len);
+        return total;
+    }
+#endif
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    if (self->outq == NULL && !self->corked
+        && send_msg(self, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0)) == -1)
+        return -1;
+    if (msg.msg_iovlen > 0)
+        outq_append_iov(self, msg.msg_iov, msg.msg_iovlen);
+    return total;
+}
+
+/* Enable queueing of output: sends no longer block when the socket's
+ * send buffer is full, and the caller must drain the queue with
+ * bufio_flush.  Meant for non-blocking sockets.
+ */
+void bufio_queue_output(struct bufio *self)
+{
+    self->queue_output = true;
+}
+
+/* Hold back output: everything sent from now on is queued, until
+ * bufio_uncork.  Ignored by the io_uring backend, which holds back
+ * sends until its next submission anyway.
+ */
+void bufio_cork(struct bufio *self)
+{
+    self->corked = true;
+}
+
+/* Stop holding back output and send what is queued, as bufio_flush. */
+int bufio_uncork(struct bufio *self)
+{
+    self->corked = false;
+    return bufio_flush(self);
+}
+
+/* Return the number of bytes of output waiting in the queue. */
+size_t bufio_queued(struct bufio *self)
+{
+    return self->outq_bytes;
+}
+
+/* Send as much queued output as the socket takes.  Adjacent byte
+ * segments are sent together with one gather write.  Unless output is
+ * queued, this waits until everything has been sent.
+ * Returns 1 if the queue is empty now, 0 if the socket's send buffer
+ * filled up first, and -1 on error.
+ */
+int bufio_flush(struct bufio *self)
+{
+    while (self->outq != NULL)
+    {
+        struct outseg *seg = self->outq;
+        if (seg->fd == -1)
+        {
+            struct iovec iov[FLUSH_IOV_MAX];
+            int n = 0;
+            for (; seg != NULL && seg->fd == -1 && n < FLUSH_IOV_MAX; seg = seg->next)
+                iov[n++] = (struct iovec) { .iov_base = seg->data + seg->off, .iov_len = seg->len };
+            // hold back a partial packet if more follows, as bufio_sendv's callers do
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+            ssize_t sent = send_msg(self, &msg, MSG_NOSIGNAL | (seg != NULL ? MSG_MORE : 0));
+            if (sent == -1)
+                return -1;
+            while (self->outq != NULL && self->outq->fd == -1 && (size_t) sent >= self->outq->len)
+            {
+                sent -= self->outq->len;
+                outq_pop(self);
+            }
+            if (sent > 0)
+            {
+                self->outq->off += sent;
+                self->outq->len -= sent;
+                self->outq_bytes -= sent;
+            }
+            if (msg.msg_iovlen > 0)
+                return 0;
+        }
+        else
+        {
+            bool eof;
+            ssize_t sent = send_file(self, seg->fd, &seg->off, seg->len, &eof);
+            if (sent == -1)
+                return -1;
+            seg->len -= sent;
+            self->outq_bytes -= sent;
+            if (seg->len > 0 && !eof)
+                return 0;
+            outq_pop(self);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Send data contained in 'resp' to the socket, retrying until all
+ * of it has been sent or an error occurs.
+ * Returns the number of bytes sent, or -1 on error.
  */
 ssize_t bufio_sendbuffer(struct bufio *self, buffer_t * resp)
 {
-    return send(self->socket, resp->buf, resp->len, MSG_NOSIGNAL);
+#ifdef HAVE_IO_URING
+    if (self->uring != NULL) {
+        // sent along with the next submission
+        buffer_append(&self->staged, resp->buf, resp->len);
+        return resp->len;
+    }
+#endif
+    if (self->queue_output || self->corked) {
+        struct iovec iov = { .iov_base = resp->buf, .iov_len = resp->len };
+        return bufio_sendv(self, &iov, 1, false);
+    }
+    return send_all(self->socket, resp->buf, resp->len);
 }
@@ -1,19 +1,37 @@
 #ifndef _BUFIO_H
 #define _BUFIO_H
 
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "buffer.h"
 
 struct bufio;   // opaque type
 // users should interact only via the public functions below
 struct bufio * bufio_create(int socket);
+struct bufio * bufio_create_fixed(int socket, size_t capacity);
 void bufio_close(struct bufio * self);
 void bufio_truncate(struct bufio * self);
 ssize_t bufio_readbyte(struct bufio *self, char *out);
 ssize_t bufio_readline(struct bufio *self, size_t *line_offset);
 ssize_t bufio_read(struct bufio *self, size_t count, size_t *buf_offset);
+ssize_t bufio_fill(struct bufio *self);
+ssize_t bufio_read_more(struct bufio *self);
+bool bufio_full(struct bufio *self);
+int bufio_socket(struct bufio *self);
+char * bufio_unread(struct bufio *self, size_t *len);
 char * bufio_offset2ptr(struct bufio *self, size_t offset);
 size_t bufio_ptr2offset(struct bufio *self, char *ptr);
-ssize_t bufio_sendfile(struct bufio *self, int fd, off_t *off, int filesize);
+ssize_t bufio_sendfile(struct bufio *self, int fd, off_t *off, size_t count);
 ssize_t bufio_sendbuffer(struct bufio *self, buffer_t *response);
+ssize_t bufio_sendv(struct bufio *self, struct iovec *iov, int iovcnt, bool more);
+void bufio_queue_output(struct bufio *self);
+void bufio_cork(struct bufio *self);
+int bufio_uncork(struct bufio *self);
+size_t bufio_queued(struct bufio *self);
+int bufio_flush(struct bufio *self);
+#ifdef HAVE_IO_URING
+bool bufio_enable_uring(struct bufio *self);
+#endif
 
 #endif /* _BUFIO_H */
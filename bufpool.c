@@ -0,0 +1,208 @@
+/*
+ * A thread-local, size-classed pool of buffers.
+ *
+ * Buffers are rounded up to a power of two.  When one is freed, it is
+ * pushed onto its class's free list in the calling thread's cache
+ * instead of being returned to malloc, and the next allocation of that
+ * class by the thread pops it again without any locking.  On the
+ * keep-alive path, where every request allocates and frees the same
+ * few buffers, this means malloc is not called at all once each
+ * thread has warmed up.
+ *
+ * Memory held by all caches together is bounded by a global
+ * high-water mark.  A buffer freed while the pools are at the mark
+ * goes back to malloc, and a thread that finds its cache over the mark
+ * when it frees something trims the cache first, so memory freed after
+ * a burst does not stay parked in the pools forever.  A thread's cache
+ * is released when the thread exits.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bufpool.h"
+
+#define NCLASSES (BUFPOOL_MAX_SHIFT - BUFPOOL_MIN_SHIFT + 1)
+
+struct free_block
+{
+    struct free_block *next;
+};
+
+struct thread_cache
+{
+    struct free_block *free[NCLASSES];
+    size_t bytes;                   // held by this cache
+};
+
+static __thread struct thread_cache cache;
+static __thread bool cache_registered;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_size_t pooled_bytes;                  // held by all caches
+static const size_t high_water = BUFPOOL_HIGH_WATER;
+
+/* Return the size class for 'size', or -1 if it is too large to pool. */
+static int size_class(size_t size)
+{
+    if (size > (1UL << BUFPOOL_MAX_SHIFT))
+        return -1;
+    if (size <= (1UL << BUFPOOL_MIN_SHIFT))
+        return 0;
+    return (64 - __builtin_clzl(size - 1)) - BUFPOOL_MIN_SHIFT;
+}
+
+static void release_cache(void *arg)
+{
+    struct thread_cache *c = arg;
+    for (int i = 0; i < NCLASSES; i++)
+    {
+        while (c->free[i] != NULL)
+        {
+            struct free_block *b = c->free[i];
+            c->free[i] = b->next;
+            free(b);
+        }
+    }
+    atomic_fetch_sub(&pooled_bytes, c->bytes);
+    c->bytes = 0;
+}
+
+static void create_cache_key(void)
+{
+    pthread_key_create(&cache_key, release_cache);
+}
+
+/* Arrange for the calling thread's cache to be released when it exits. */
+static void register_cache(void)
+{
+    pthread_once(&cache_key_once, create_cache_key);
+    pthread_setspecific(cache_key, &cache);
+    cache_registered = true;
+}
+
+/* Give the largest cached buffers back to malloc until the pools are
+ * below the high-water mark or this cache is empty. */
+static void trim_cache(void)
+{
+    for (int i = NCLASSES - 1; i >= 0 && atomic_load(&pooled_bytes) > high_water; i--)
+    {
+        while (cache.free[i] != NULL && atomic_load(&pooled_bytes) > high_water)
+        {
+            struct free_block *b = cache.free[i];
+            cache.free[i] = b->next;
+            cache.bytes -= 1UL << (i + BUFPOOL_MIN_SHIFT);
+            atomic_fetch_sub(&pooled_bytes, 1UL << (i + BUFPOOL_MIN_SHIFT));
+            free(b);
+        }
+    }
+}
+
+/**
+ * Allocate a buffer of at least 'size' bytes.
+ * @param size The number of bytes needed
+ * @param cap Set to the usable size of the buffer, to be passed back on free
+ * @return the buffer, or NULL if size is 0 or memory is exhausted
+ */
+void *bufpool_alloc(size_t size, size_t *cap)
+{
+    if (size == 0)
+    {
+        *cap = 0;
+        return NULL;
+    }
+
+    int cls = size_class(size);
+    if (cls < 0)
+    {
+        *cap = size;
+        return malloc(size);
+    }
+
+    *cap = 1UL << (cls + BUFPOOL_MIN_SHIFT);
+    struct free_block *b = cache.free[cls];
+    if (b == NULL)
+        return malloc(*cap);
+
+    cache.free[cls] = b->next;
+    cache.bytes -= *cap;
+    atomic_fetch_sub(&pooled_bytes, *cap);
+    return b;
+}
+
+/**
+ * Return a buffer to the pool.
+ * @param p The buffer, or NULL
+ * @param cap Its usable size as reported by bufpool_alloc or bufpool_realloc,
+ *            or the size originally asked for, which maps to the same class
+ */
+void bufpool_free(void *p, size_t cap)
+{
+    if (p == NULL)
+        return;
+
+    int cls = size_class(cap);
+    if (cls < 0)
+    {
+        free(p);
+        return;
+    }
+    cap = 1UL << (cls + BUFPOOL_MIN_SHIFT);
+
+    if (atomic_load(&pooled_bytes) + cap > high_water)
+    {
+        trim_cache();
+        if (atomic_load(&pooled_bytes) + cap > high_water)
+        {
+            free(p);
+            return;
+        }
+    }
+    if (!cache_registered)
+        register_cache();
+
+    struct free_block *b = p;
+    b->next = cache.free[cls];
+    cache.free[cls] = b;
+    cache.bytes += cap;
+    atomic_fetch_add(&pooled_bytes, cap);
+}
+
+/**
+ * Grow or shrink a buffer.
+ * @param p The buffer, or NULL
+ * @param len The number of bytes in it to preserve
+ * @param oldcap Its usable size
+ * @param size The number of bytes needed
+ * @param cap Set to the usable size of the resulting buffer
+ * @return the resulting buffer, which may be p, or NULL if memory is exhausted
+ */
+void *bufpool_realloc(void *p, size_t len, size_t oldcap, size_t size, size_t *cap)
+{
+    if (p != NULL && size_class(size) < 0 && size_class(oldcap) < 0)
+    {
+        *cap = size;
+        return realloc(p, size);
+    }
+    if (p != NULL && size_class(size) == size_class(oldcap))
+    {
+        *cap = oldcap;
+        return p;
+    }
+
+    void *q = bufpool_alloc(size, cap);
+    if (q == NULL && size > 0)
+        return NULL;
+    if (p != NULL)
+    {
+        if (q != NULL)
+            memcpy(q, p, len < *cap ? len : *cap);
+        bufpool_free(p, oldcap);
+    }
+    return q;
+}
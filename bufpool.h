@@ -0,0 +1,18 @@
+#ifndef _BUFPOOL_H
+#define _BUFPOOL_H
+
+#include <stddef.h>
+
+/* Buffers of up to 1 << BUFPOOL_MAX_SHIFT bytes are pooled, in
+ * power-of-two size classes starting at 1 << BUFPOOL_MIN_SHIFT. */
+#define BUFPOOL_MIN_SHIFT 6
+#define BUFPOOL_MAX_SHIFT 17
+
+/* Most memory all threads' pools may hold together. */
+#define BUFPOOL_HIGH_WATER (64 * 1024 * 1024)
+
+void *bufpool_alloc(size_t size, size_t *cap);
+void *bufpool_realloc(void *p, size_t len, size_t oldcap, size_t size, size_t *cap);
+void bufpool_free(void *p, size_t cap);
+
+#endif /* _BUFPOOL_H */
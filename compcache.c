@@ -0,0 +1,357 @@
+/*
+ * Content-coding negotiation and a cache of compressed files.
+ *
+ * Files for which no precompressed sidecar exists (see filecache.c)
+ * are compressed with gzip when a client accepts it, provided that
+ * their type compresses well and they are no larger than COMPRESS_MAX.
+ * The result is kept as a complete pre-rendered response, keyed by the
+ * file's device, inode, mtime and size, so a changed file is compressed
+ * anew.  Files that do not shrink by at least a tenth are remembered
+ * too, so that they are not compressed again.
+ *
+ * The cache is shared by all threads, bounded by the memory its
+ * entries take, and evicts the least recently used entry first.
+ */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "http.h"
+#include "filecache.h"
+#include "compcache.h"
+
+#define COMPRESS_MAX (1024 * 1024)
+#define NBUCKETS 1024
+
+const char *const content_encoding_names[ENCODING_COUNT] = { "br", "gzip" };
+const char *const content_encoding_suffixes[ENCODING_COUNT] = { ".br", ".gz" };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct compressed *buckets[NBUCKETS];
+static struct compressed lru = { .lru_prev = &lru, .lru_next = &lru };  // most recently used first
+static long max_cache_bytes;        // 0 disables compression on the fly
+static long cache_bytes;
+static int nentries;
+static atomic_ulong hits, misses;
+
+/**
+ * Size the cache.
+ * @param max_bytes The memory compressed files may take, 0 to never compress on the fly
+ */
+void compcache_init(long max_bytes)
+{
+    max_cache_bytes = max_bytes;
+}
+
+/**
+ * Parse an Accept-Encoding header.
+ * @param accept_encoding The header's value
+ * @return A bit set, indexed by enum content_encoding, of the codings
+ *         the client accepts
+ */
+unsigned compcache_accepted(const char *accept_encoding)
+{
+    unsigned listed = 0, accepted = 0;
+    bool star = false;
+    const char *p = accept_encoding;
+    while (*p != '\0')
+    {
+        p += strspn(p, " \t,");
+        size_t len = strcspn(p, " \t,;");
+        const char *name = p;
+        p += len;
+
+        // a q-value of 0 means "not acceptable"
+        double q = 1;
+        while (*(p += strspn(p, " \t")) == ';')
+        {
+            p += 1 + strspn(p + 1, " \t");
+            if (!strncasecmp(p, "q=", 2))
+                q = strtod(p + 2, NULL);
+            p += strcspn(p, ",;");
+        }
+
+        if (len == 1 && *name == '*')
+        {
+            star = q > 0;
+            continue;
+        }
+        for (int i = 0; i < ENCODING_COUNT; i++)
+        {
+            const char *coding = content_encoding_names[i];
+            if (len == strlen(coding) && !strncasecmp(name, coding, len))
+            {
+                listed |= 1u << i;
+                if (q > 0)
+                    accepted |= 1u << i;
+            }
+        }
+    }
+    if (star)
+        accepted |= ~listed & ((1u << ENCODING_COUNT) - 1);
+    return accepted;
+}
+
+/**
+ * Check whether a file is worth compressing on the fly.
+ * @param mime The file's Content-Type
+ * @param size The file's size
+ * @return true for text-like types of limited size, if compression is enabled
+ */
+bool compcache_compressible(const struct mime_type *mime, off_t size)
+{
+    return max_cache_bytes > 0 && size > 0 && size <= COMPRESS_MAX && mime->compressible;
+}
+
+/* Hash a file's identity only, so that all its versions share a chain. */
+static uint32_t hash_key(struct filecache_entry *file)
+{
+    uint64_t words[2] = { file->dev, file->ino };
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof words; i++)
+        h = (h ^ ((unsigned char *) words)[i]) * 16777619u;
+    return h;
+}
+
+static struct compressed *lookup(struct filecache_entry *file, uint32_t hash)
+{
+    for (struct compressed *c = buckets[hash % NBUCKETS]; c != NULL; c = c->next)
+    {
+        if (c->hash == hash && c->size == file->size && c->mtime.tv_sec == file->mtime.tv_sec
+            && c->mtime.tv_nsec == file->mtime.tv_nsec && c->ino == file->ino && c->dev == file->dev)
+            return c;
+    }
+    return NULL;
+}
+
+static void lru_unlink(struct compressed *c)
+{
+    c->lru_prev->lru_next = c->lru_next;
+    c->lru_next->lru_prev = c->lru_prev;
+}
+
+static void lru_push(struct compressed *c)
+{
+    c->lru_next = lru.lru_next;
+    c->lru_prev = &lru;
+    lru.lru_next->lru_prev = c;
+    lru.lru_next = c;
+}
+
+/* Take 'c' out of the cache.  The caller then drops the cache's reference. */
+static void remove_entry(struct compressed *c)
+{
+    struct compressed **pp = &buckets[c->hash % NBUCKETS];
+    while (*pp != c)
+        pp = &(*pp)->next;
+    *pp = c->next;
+    lru_unlink(c);
+    cache_bytes -= c->charge;
+    nentries--;
+}
+
+/**
+ * Drop a reference obtained from compcache_get.
+ * @param c The compressed file, which must not be used afterwards
+ */
+void compcache_put(struct compressed *c)
+{
+    if (atomic_fetch_sub(&c->refs, 1) == 1)
+        free(c);
+}
+
+/* Read the whole file, from its in-memory response if it has one. */
+static char *file_contents(struct filecache_entry *file, bool *allocated)
+{
+    *allocated = false;
+    if (file->response != NULL)
+        return (char *) file->response + file->response_head_len + 2;
+
+    char *data = malloc(file->size);
+    if (data == NULL)
+        return NULL;
+    off_t n = 0;
+    ssize_t rc;
+    while (n < file->size && (rc = pread(file->fd, data + n, file->size - n, n)) > 0)
+        n += rc;
+    if (n < file->size)
+    {
+        free(data);
+        return NULL;
+    }
+    *allocated = true;
+    return data;
+}
+
+/* Compress 'len' bytes at 'src' into 'dst' with gzip framing.
+ * Returns the compressed size, or 0 if it does not fit into 'cap'. */
+static size_t gzip(const char *src, size_t len, char *dst, size_t cap)
+{
+    z_stream zs = { 0 };
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+    zs.next_in = (Bytef *) src;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *) dst;
+    zs.avail_out = cap;
+    int rc = deflate(&zs, Z_FINISH);
+    size_t out = zs.total_out;
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END ? out : 0;
+}
+
+/* Compress a file into a new, unshared entry with one reference. */
+static struct compressed *compress_file(struct filecache_entry *file, uint32_t hash)
+{
+    bool allocated;
+    char *data = file_contents(file, &allocated);
+    if (data == NULL)
+        return NULL;
+
+    // only keep the result if it saves at least a tenth
+    size_t cap = file->size - file->size / 10;
+    char *out = malloc(cap);
+    size_t len = out != NULL ? gzip(data, file->size, out, cap) : 0;
+    if (allocated)
+        free(data);
+
+    char etag[56], head[512];
+    size_t head_len = 0;
+    snprintf(etag, sizeof etag, "%.*s-gzip\"", (int) strlen(file->etag) - 1, file->etag);
+    if (len > 0)
+        head_len = http_render_file_head(head, sizeof head, file->mime, file->last_modified,
+                                         true, len, etag, "gzip");
+    size_t response_len = head_len > 0 ? head_len + 2 + len : 0;
+
+    struct compressed *c = malloc(sizeof(*c) + response_len);
+    if (c == NULL)
+    {
+        perror("can't alloc memory: ");
+        exit(EXIT_FAILURE);
+    }
+    memset(c, 0, sizeof(*c));
+    c->dev = file->dev;
+    c->ino = file->ino;
+    c->mtime = file->mtime;
+    c->size = file->size;
+    c->hash = hash;
+    c->charge = sizeof(*c) + response_len;
+    memcpy(c->etag, etag, sizeof etag);
+    atomic_init(&c->refs, 1);
+    if (response_len > 0)
+    {
+        char *response = (char *) (c + 1);
+        memcpy(response, head, head_len);
+        memcpy(response + head_len, "\r\n", 2);
+        memcpy(response + head_len + 2, out, len);
+        c->response = response;
+        c->response_len = response_len;
+        c->response_head_len = head_len;
+    }
+    free(out);
+    return c;
+}
+
+/**
+ * Look up the gzip-compressed form of a file, compressing it on a miss.
+ * @param file A file for which compcache_compressible holds
+ * @return The compressed file, to be released with compcache_put, or
+ *         NULL if it could not be read.  Its response is NULL if the
+ *         file does not compress well.
+ */
+struct compressed *compcache_get(struct filecache_entry *file)
+{
+    uint32_t hash = hash_key(file);
+    pthread_mutex_lock(&lock);
+    struct compressed *c = lookup(file, hash);
+    if (c != NULL)
+    {
+        atomic_fetch_add(&c->refs, 1);
+        lru_unlink(c);
+        lru_push(c);
+    }
+    pthread_mutex_unlock(&lock);
+    if (c != NULL)
+    {
+        atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+        return c;
+    }
+
+    atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+    c = compress_file(file, hash);
+    if (c == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&lock);
+    struct compressed *other = lookup(file, hash);
+    if (other != NULL)
+    {
+        // another thread compressed the file meanwhile
+        atomic_fetch_add(&other->refs, 1);
+        pthread_mutex_unlock(&lock);
+        compcache_put(c);
+        return other;
+    }
+    while (cache_bytes + c->charge > max_cache_bytes && lru.lru_prev != &lru)
+    {
+        struct compressed *victim = lru.lru_prev;
+        remove_entry(victim);
+        compcache_put(victim);
+    }
+    if (cache_bytes + c->charge <= max_cache_bytes)
+    {
+        struct compressed **bucket = &buckets[hash % NBUCKETS];
+        c->next = *bucket;
+        *bucket = c;
+        lru_push(c);
+        cache_bytes += c->charge;
+        nentries++;
+        atomic_fetch_add(&c->refs, 1);      // the cache's reference
+    }
+    pthread_mutex_unlock(&lock);
+    return c;
+}
+
+/**
+ * Drop the compressed forms of all versions of a file, which changed or
+ * was removed, rather than waiting for them to be evicted.
+ * @param file The file
+ */
+void compcache_forget(struct filecache_entry *file)
+{
+    uint32_t hash = hash_key(file);
+    pthread_mutex_lock(&lock);
+    struct compressed *c = buckets[hash % NBUCKETS];
+    while (c != NULL)
+    {
+        struct compressed *next = c->next;
+        if (c->ino == file->ino && c->dev == file->dev)
+        {
+            remove_entry(c);
+            compcache_put(c);
+        }
+        c = next;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Report how the cache is doing.
+ * @param st Filled with the counters and current usage
+ */
+void compcache_get_stats(struct compcache_stats *st)
+{
+    st->hits = atomic_load(&hits);
+    st->misses = atomic_load(&misses);
+    pthread_mutex_lock(&lock);
+    st->entries = nentries;
+    st->bytes = cache_bytes;
+    pthread_mutex_unlock(&lock);
+}
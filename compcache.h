@@ -0,0 +1,61 @@
+#ifndef _COMPCACHE_H
+#define _COMPCACHE_H
+
+#include <sys/types.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Content codings a file may be sent with, in order of preference. */
+enum content_encoding {
+    ENCODING_BR,
+    ENCODING_GZIP,
+    ENCODING_COUNT,
+    ENCODING_IDENTITY = ENCODING_COUNT
+};
+
+extern const char *const content_encoding_names[ENCODING_COUNT];
+extern const char *const content_encoding_suffixes[ENCODING_COUNT];
+
+struct filecache_entry;
+struct mime_type;
+
+/*
+ * A gzip-compressed file, as a complete pre-rendered response like
+ * those of the file cache.  Reference counted like file cache entries.
+ */
+struct compressed {
+    const char *response;           // NULL if the file does not compress well
+    size_t response_len;
+    size_t response_head_len;       // the headers end here, before the blank line
+    char etag[56];
+
+    // private to compcache.c
+    struct compressed *next;        // in the hash chain
+    struct compressed *lru_prev, *lru_next;
+    dev_t dev;                      // the file's identity
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    uint32_t hash;
+    size_t charge;                  // bytes counted against the budget
+    atomic_int refs;
+};
+
+struct compcache_stats {
+    unsigned long hits;
+    unsigned long misses;           // files compressed
+    int entries;
+    long bytes;
+};
+
+void compcache_init(long max_bytes);
+unsigned compcache_accepted(const char *accept_encoding);
+bool compcache_compressible(const struct mime_type *mime, off_t size);
+struct compressed *compcache_get(struct filecache_entry *file);
+void compcache_put(struct compressed *c);
+void compcache_forget(struct filecache_entry *file);
+void compcache_get_stats(struct compcache_stats *st);
+
+#endif /* _COMPCACHE_H */
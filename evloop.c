@@ -0,0 +1,443 @@
+/*
+ * Event-driven connection engine.
+ *
+ * Instead of dedicating a thread to each connection, a small number of
+ * event loop threads multiplex non-blocking client sockets using
+ * edge-triggered epoll.  Each loop waits on a listening socket and on
+ * the sockets of the clients it accepted.  With a single listening
+ * socket, all loops share it (registered with EPOLLEXCLUSIVE so that
+ * only one loop is woken per incoming connection); with SO_REUSEPORT
+ * shards, each loop gets a listening socket of its own.
+ *
+ * Whenever a client socket becomes readable, all available data is
+ * drained into the connection's bufio.  http_handle_transaction is run
+ * only once a complete request is buffered, so it never blocks waiting
+ * for request data.  The responses to all requests buffered at that
+ * point are corked and then written together, as far as the socket's
+ * send buffer allows; the rest is queued in the connection's bufio and
+ * sent as the socket becomes writable.  While more than
+ * OUTPUT_QUEUE_LIMIT bytes are queued, the loop stops reading and
+ * handling further pipelined requests from that client, so a client
+ * that does not read its responses cannot make the server buffer
+ * without bound.
+ *
+ * Each loop keeps the idle, header and body deadlines of its clients
+ * in a timing wheel of its own, which it advances after every wakeup.
+ */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "socket.h"
+#include "bufio.h"
+#include "evloop.h"
+#include "admission.h"
+#include "globals.h"
+
+extern jwtmgr *jwtlib;
+
+#define MAX_EVENTS 256
+#define OUTPUT_QUEUE_LIMIT (256 * 1024)
+
+/* Per-connection state owned by one event loop. */
+struct evconn
+{
+    int fd;
+    struct http_client client;
+    struct http_transaction ta;
+    bool closing;               // close once the queued output is sent
+};
+
+struct evloop
+{
+    pthread_t thread;
+    int epfd;
+    int listensocket;
+    struct timerwheel wheel;    // deadlines of this loop's clients
+};
+
+/**
+ * Release a connection, closing its socket.
+ * Closing the socket also removes it from the epoll set.
+ * @param conn The connection to be closed
+ */
+static void evconn_close(struct evconn *conn)
+{
+    http_client_set_phase(&conn->client, HTTP_PHASE_BUSY);
+    bufio_close(conn->client.bufio);
+    arena_destroy(&conn->ta.arena);
+    free(conn);
+    admission_conn_close();
+}
+
+/**
+ * Called when a client misses a deadline.  A client that stalled in the
+ * middle of a request is told so with a 408 before it is disconnected.
+ * @param deadline The client's deadline timer
+ */
+static void evconn_expired(struct timer *deadline)
+{
+    struct evconn *conn = (struct evconn *)
+        ((char *)deadline - offsetof(struct evconn, client.deadline));
+
+    if ((conn->client.phase == HTTP_PHASE_HEADER || conn->client.phase == HTTP_PHASE_BODY)
+        && bufio_queued(conn->client.bufio) == 0)
+    {
+        http_send_request_timeout(&conn->client);
+    }
+    evconn_close(conn);
+}
+
+/**
+ * Accept all pending clients and register them with this loop.
+ * @param loop The event loop that accepts the clients
+ */
+static void evloop_accept(struct evloop *loop)
+{
+    for (;;)
+    {
+        int client_socket = socket_accept_client_flags(loop->listensocket, SOCK_NONBLOCK);
+        if (client_socket == -1)
+        {
+            // EAGAIN: another loop got there first, or the queue is empty
+            return;
+        }
+        if (!admission_conn_open(client_socket))
+        {
+            continue;
+        }
+
+        struct evconn *conn = calloc(1, sizeof(*conn));
+        if (conn == NULL)
+        {
+            perror("calloc");
+            close(client_socket);
+            admission_conn_close();
+            continue;
+        }
+        conn->fd = client_socket;
+        http_setup_client(&conn->client, bufio_capacity > 0 ? bufio_create_fixed(client_socket, bufio_capacity)
+                                                            : bufio_create(client_socket));
+        http_client_set_timeouts(&conn->client, &loop->wheel, NULL);
+        conn->client.deadline.fn = evconn_expired;
+        http_client_set_phase(&conn->client, HTTP_PHASE_IDLE);
+        bufio_queue_output(conn->client.bufio);
+
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = conn
+        };
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client_socket, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            evconn_close(conn);
+        }
+    }
+}
+
+/**
+ * Wait for queued output to drain.  A connection that is to be closed
+ * is kept open until its responses are sent.
+ * @param conn The connection
+ * @return true; the connection stays open
+ */
+static bool evconn_wait_writable(struct evconn *conn)
+{
+    http_client_set_phase(&conn->client, HTTP_PHASE_WRITE);
+    return true;
+}
+
+/**
+ * Drain a client socket and run one transaction per complete buffered
+ * request, until the output queue is above its limit.
+ * @param conn The connection that became readable
+ * @param head_complete Set to whether the head of an incomplete request is buffered
+ * @return false if the connection must be closed once its output is sent
+ */
+static bool evconn_serve(struct evconn *conn, bool *head_complete)
+{
+    struct bufio *bufio = conn->client.bufio;
+    // a fixed-capacity buffer may fill up before the socket is drained;
+    // with edge triggering nobody will tell us about the rest, so once
+    // transactions have made room, read on
+    for (;;)
+    {
+        *head_complete = false;
+        if (bufio_queued(bufio) > OUTPUT_QUEUE_LIMIT)
+        {
+            // the client is not reading; leave its requests in the socket
+            return true;
+        }
+
+        ssize_t rc = bufio_fill(bufio);
+        if (rc == -1 && errno != EAGAIN)
+        {
+            return false;
+        }
+        bool eof = rc == 0;
+        bool full = bufio_full(bufio);
+
+        for (;;)
+        {
+            int ready = http_request_ready(&conn->client, head_complete);
+            if (ready < 0)
+            {
+                return false;
+            }
+            if (ready == 0)
+            {
+                if (full && bufio_full(bufio))
+                {
+                    // this request alone does not fit
+                    http_send_request_too_large(&conn->client, *head_complete);
+                    return false;
+                }
+                if (full)
+                {
+                    break;
+                }
+                // a peer that hung up will never complete its request
+                return !eof;
+            }
+
+            http_transaction_init(&conn->ta, jwtlib);
+
+            bool ret = http_handle_transaction(&conn->ta, &conn->client);
+            http_transaction_clean(&conn->ta);
+            if (ret == false || conn->ta.IsKeepAlive != 1)
+            {
+                return false;
+            }
+            bufio_truncate(bufio);
+
+            if (bufio_queued(bufio) > OUTPUT_QUEUE_LIMIT)
+            {
+                // send this batch before taking on more requests
+                if (bufio_uncork(bufio) == -1)
+                {
+                    return false;
+                }
+                bufio_cork(bufio);
+                if (bufio_queued(bufio) > OUTPUT_QUEUE_LIMIT)
+                {
+                    return true;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Handle a readiness notification for a client socket.
+ * The responses to the pipelined requests handled in one go are
+ * corked, and sent together with as few gather writes as possible.
+ * @param conn The connection that became readable
+ * @return false if the connection must be closed
+ */
+static bool evconn_readable(struct evconn *conn)
+{
+    struct bufio *bufio = conn->client.bufio;
+    bool head_complete;
+    bufio_cork(bufio);
+    bool keep = evconn_serve(conn, &head_complete);
+    if (bufio_uncork(bufio) == -1)
+    {
+        return false;
+    }
+    if (bufio_queued(bufio) > 0)
+    {
+        conn->closing = !keep;
+        return evconn_wait_writable(conn);
+    }
+    if (!keep)
+    {
+        return false;
+    }
+
+    size_t unread;
+    bufio_unread(bufio, &unread);
+    http_client_set_phase(&conn->client, head_complete ? HTTP_PHASE_BODY
+                          : unread > 0 ? HTTP_PHASE_HEADER : HTTP_PHASE_IDLE);
+    return true;
+}
+
+/**
+ * Handle a readiness notification for a client socket: send queued
+ * output, then take in new requests.
+ * @param conn The connection
+ * @param events The events epoll reported
+ * @return false if the connection must be closed
+ */
+static bool evconn_ready(struct evconn *conn, uint32_t events)
+{
+    struct bufio *bufio = conn->client.bufio;
+    size_t queued = bufio_queued(bufio);
+    if (queued > 0)
+    {
+        int rc = bufio_flush(bufio);
+        if (rc == -1)
+        {
+            return false;
+        }
+        if (rc == 0)
+        {
+            if (bufio_queued(bufio) < queued)
+            {
+                // the client is reading; restart its deadline
+                http_client_set_phase(&conn->client, HTTP_PHASE_BUSY);
+            }
+            if (conn->closing || bufio_queued(bufio) > OUTPUT_QUEUE_LIMIT)
+            {
+                return evconn_wait_writable(conn);
+            }
+        }
+    }
+    if (conn->closing)
+    {
+        return bufio_queued(bufio) > 0;
+    }
+
+    // requests left unread while the queue was full are read now
+    if ((events & ~EPOLLOUT) != 0 || queued > 0)
+    {
+        return evconn_readable(conn);
+    }
+    return true;
+}
+
+/**
+ * Body of an event loop thread.
+ * @param args The struct evloop this thread runs
+ */
+static void *evloop_thread(void *args)
+{
+    struct evloop *loop = args;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;)
+    {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, TIMERWHEEL_TICK_MS);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            struct evconn *conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                evloop_accept(loop);
+            }
+            else if (!evconn_ready(conn, events[i].events))
+            {
+                evconn_close(conn);
+            }
+        }
+        timerwheel_advance(&loop->wheel, timerwheel_clock());
+    }
+    return NULL;
+}
+
+/**
+ * Raise the soft limit on open files to the hard limit, since
+ * a single process now holds every client socket.
+ */
+static void raise_nofile_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/**
+ * Serve clients using 'nthreads' event loop threads.  Loop i accepts
+ * clients on listensockets[i % nsockets].
+ * Does not return unless the loops could not be started or all of them exit.
+ * @param listensockets The listening sockets
+ * @param nsockets The number of listening sockets
+ * @param nthreads The number of event loop threads
+ * @param pin Whether to pin loop i to CPU i
+ * @return return -1 if the event loops could not be started, otherwise 0
+ */
+int evloop_run(int *listensockets, int nsockets, int nthreads, bool pin)
+{
+    for (int i = 0; i < nsockets; i++)
+    {
+        int flags = fcntl(listensockets[i], F_GETFL);
+        if (flags == -1 || fcntl(listensockets[i], F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            perror("fcntl");
+            return -1;
+        }
+    }
+    raise_nofile_limit();
+
+    struct evloop *loops = calloc(nthreads, sizeof(*loops));
+    if (loops == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+
+    int started = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        struct evloop *loop = &loops[i];
+        loop->listensocket = listensockets[i % nsockets];
+        timerwheel_init(&loop->wheel, timerwheel_clock());
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd == -1)
+        {
+            perror("epoll_create1");
+            break;
+        }
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (nsockets < nthreads)
+            ev.events |= EPOLLEXCLUSIVE;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listensocket, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            close(loop->epfd);
+            break;
+        }
+
+        if (pthread_create(&loop->thread, NULL, evloop_thread, loop) != 0)
+        {
+            fprintf(stderr, "Create event loop thread error!\n");
+            close(loop->epfd);
+            break;
+        }
+        if (pin)
+        {
+            pin_thread_to_cpu(loop->thread, i);
+        }
+        started++;
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(loops[i].thread, NULL);
+    }
+    free(loops);
+    return started == 0 ? -1 : 0;
+}
@@ -0,0 +1,8 @@
+#ifndef _EVLOOP_H
+#define _EVLOOP_H
+
+#include <stdbool.h>
+
+int evloop_run(int *listensockets, int nsockets, int nthreads, bool pin);
+
+#endif /* _EVLOOP_H */
@@ -0,0 +1,757 @@
+/*
+ * Cache of open static files.
+ *
+ * Serving a file from scratch takes an openat2 below the server root
+ * and an fstat.  The cache keeps the outcome per request path: an open
+ * descriptor, the file's size, mtime and MIME type, along with the
+ * validators sent as ETag and Last-Modified, and descriptors for precompressed sidecar files
+ * (file.br, file.gz) that are at least as new as the file.  A warm hit
+ * costs a shard lock and a hash lookup, and no system calls.  At most every 'ttl' seconds, a hit
+ * checks its file with a single stat of its path; a file that was
+ * replaced or modified is opened afresh.
+ *
+ * While the watcher (watcher.c) covers the tree, the TTL is not used:
+ * it reports changes, which it pushes through a lock-free queue that
+ * the serving threads drain, and the entries for changed paths are
+ * dropped.  If it loses track, all entries are checked again.  Entries
+ * reached through symbolic links, whose targets may change under other
+ * names, are still checked every 'ttl' seconds.
+ *
+ * Paths are resolved with openat2(RESOLVE_BENEATH) relative to a
+ * descriptor of the server root, so that neither ".." nor symbolic
+ * links lead outside it, without a realpath walk.  Kernels without
+ * openat2 fall back to realpath and a prefix check, as do paths that
+ * openat2 refuses, which may hold absolute links to files below the
+ * root.
+ *
+ * The table is split into shards, each with its own lock, hash chains
+ * and LRU list, so that threads serving different files rarely
+ * contend.  Two limits bound it: the number of entries, and the
+ * number of descriptors held.  Each shard gets an equal share of both
+ * and evicts its own entries to stay within it, so that eviction always
+ * frees what is short.  Evicted entries that are still being sent keep
+ * their descriptors until they are done.  If a shard cannot make room,
+ * the file is served without being cached.
+ *
+ * A file of up to RESPONSE_MAX bytes is instead kept in memory as its
+ * complete response: status line, headers and body in one block, so
+ * that a hit is sent with a single write.  Such an entry holds no
+ * descriptor.  The memory these responses take is a third limit.
+ *
+ * Lookups that fail because there is no such file, or because the path
+ * names a directory, are cached as negative entries, so that repeated
+ * requests for them (such as client-side routes answered by the HTML5
+ * fallback) do not touch the file system either.  They take at most a
+ * quarter of each shard, and only room that is free.  One path may be pinned: its entry is never
+ * evicted, only replaced when its file changes.
+ */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "globals.h"
+#include "filecache.h"
+
+#define NSHARDS 16
+#define RESPONSE_MAX (64 * 1024)
+#define NOTIFY_SLOTS 1024
+
+struct shard {
+    pthread_mutex_t lock;
+    struct filecache_entry **buckets;
+    unsigned mask;
+    struct filecache_entry lru;     // list head; most recently used first; without pinned entries
+    int nentries;
+    int nnegative;                  // entries for failed lookups
+    int nfds;                       // descriptors held by its entries
+    long nbytes;                    // memory held by its in-memory responses
+};
+
+static struct shard shards[NSHARDS];
+static int max_shard_entries;       // 0 disables caching
+static int max_shard_negative;
+static const char *pinned_path;
+static int max_shard_fds;
+static long max_response_bytes;     // 0 disables in-memory responses
+static long max_shard_bytes;
+static int ttl_seconds;
+static int root_fd;                 // O_PATH descriptor of the server root
+static atomic_bool no_openat2;      // set if the kernel lacks openat2
+static atomic_bool watched;         // whether the watcher reports all changes
+static atomic_uint generation;      // bumped to have all entries checked again
+
+// changed paths, from the watcher thread to whichever thread drains them
+static char *notify_ring[NOTIFY_SLOTS];
+static atomic_uint notify_head, notify_tail;
+static atomic_bool notify_all;      // the ring overflowed, or a directory changed
+static atomic_flag draining = ATOMIC_FLAG_INIT;
+static atomic_uint notify_seq;      // counts the paths drained
+static atomic_int open_fds;
+static atomic_long response_bytes;
+static atomic_int nentries;
+static atomic_ulong hits, misses, response_hits, negative_hits;
+
+/* FNV-1a */
+static uint32_t hash_path(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+static time_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Size the cache and open the server root, which must be set.
+ * Must be called before any other function.
+ * @param max_entries The maximum number of cached files, 0 to disable caching
+ * @param max_fds The maximum number of descriptors cached files may hold
+ * @param max_bytes The memory available to in-memory responses, 0 for none
+ * @param ttl Seconds for which a cached file is used without checking it
+ */
+void filecache_init(int max_entries, int max_fds, long max_bytes, int ttl)
+{
+    max_shard_entries = (max_entries + NSHARDS - 1) / NSHARDS;
+    max_shard_negative = (max_shard_entries + 3) / 4;
+    max_shard_fds = (max_fds + NSHARDS - 1) / NSHARDS;
+    max_response_bytes = max_bytes;
+    max_shard_bytes = (max_bytes + NSHARDS - 1) / NSHARDS;
+    ttl_seconds = ttl;
+
+    root_fd = open(server_root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1)
+    {
+        perror("can't open server root: ");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned nbuckets = 1;
+    while (nbuckets < 2 * max_shard_entries)
+        nbuckets <<= 1;
+    for (int i = 0; i < NSHARDS; i++)
+    {
+        struct shard *s = &shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->buckets = calloc(nbuckets, sizeof(*s->buckets));
+        if (s->buckets == NULL)
+        {
+            perror("can't alloc memory: ");
+            exit(EXIT_FAILURE);
+        }
+        s->mask = nbuckets - 1;
+        s->lru.lru_prev = s->lru.lru_next = &s->lru;
+    }
+}
+
+static void lru_unlink(struct filecache_entry *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push(struct shard *s, struct filecache_entry *e)
+{
+    e->lru_next = s->lru.lru_next;
+    e->lru_prev = &s->lru;
+    s->lru.lru_next->lru_prev = e;
+    s->lru.lru_next = e;
+}
+
+static struct filecache_entry *lookup(struct shard *s, const char *path, uint32_t hash)
+{
+    for (struct filecache_entry *e = s->buckets[hash & s->mask]; e != NULL; e = e->next)
+    {
+        if (e->hash == hash && !strcmp(e->key, path))
+            return e;
+    }
+    return NULL;
+}
+
+/* Count the descriptors 'e' holds, its file's and its sidecars'. */
+static int entry_fds(const struct filecache_entry *e)
+{
+    int n = e->fd != -1;
+    for (int i = 0; i < ENCODING_COUNT; i++)
+        n += e->sidecars[i].fd != -1;
+    return n;
+}
+
+/* Take 'e' out of its shard.  The caller then drops the cache's reference. */
+static void shard_remove(struct shard *s, struct filecache_entry *e)
+{
+    struct filecache_entry **pp = &s->buckets[e->hash & s->mask];
+    while (*pp != e)
+        pp = &(*pp)->next;
+    *pp = e->next;
+    lru_unlink(e);
+    s->nentries--;
+    if (e->error != 0)
+        s->nnegative--;
+    s->nfds -= entry_fds(e);
+    s->nbytes -= e->response_len;
+    atomic_fetch_sub(&nentries, 1);
+}
+
+/* Check whether adding 'e' would take the shard over one of its limits. */
+static bool over_limits(struct shard *s, struct filecache_entry *e)
+{
+    return s->nentries >= max_shard_entries || s->nfds + entry_fds(e) > max_shard_fds
+           || s->nbytes + (long) e->response_len > max_shard_bytes;
+}
+
+/**
+ * Drop a reference obtained from filecache_get.
+ * @param e The entry, which must not be used afterwards
+ */
+void filecache_put(struct filecache_entry *e)
+{
+    if (atomic_fetch_sub(&e->refs, 1) == 1)
+    {
+        if (e->fd != -1)
+        {
+            close(e->fd);
+            atomic_fetch_sub(&open_fds, 1);
+        }
+        for (int i = 0; i < ENCODING_COUNT; i++)
+        {
+            if (e->sidecars[i].fd != -1)
+            {
+                close(e->sidecars[i].fd);
+                atomic_fetch_sub(&open_fds, 1);
+            }
+        }
+        atomic_fetch_sub(&response_bytes, e->response_len);
+        free(e);
+    }
+}
+
+/* Format a strong ETag that changes whenever the file is replaced or modified. */
+static void format_etag(char *buf, size_t size, const struct stat *st)
+{
+    snprintf(buf, size, "\"%llx-%llx-%llx\"", (unsigned long long) st->st_ino,
+             (unsigned long long) st->st_size,
+             (unsigned long long) st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec);
+}
+
+/* Turn a normalised request path into one relative to the root. */
+static const char *relative(const char *path)
+{
+    return path[1] != '\0' ? path + 1 : ".";
+}
+
+static int openat2_beneath(const char *rel, uint64_t resolve)
+{
+    struct open_how how = {
+        .flags = O_RDONLY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | resolve,
+    };
+    int fd, tries = 0;
+    // EAGAIN: a concurrent rename kept the kernel from checking a ".." step
+    do
+        fd = syscall(SYS_openat2, root_fd, rel, &how, sizeof how);
+    while (fd == -1 && errno == EAGAIN && ++tries < 3);
+    return fd;
+}
+
+/* Open 'rel', relative to the server root, for reading, such that
+ * neither ".." nor symbolic links can lead outside the root.  Sets
+ * *via_link if the path may have gone through a symbolic link.
+ * Returns the descriptor, or -1 with errno set; ENOENT also reports a
+ * path that would leave the root. */
+static int open_beneath(const char *rel, bool *via_link)
+{
+    if (!atomic_load_explicit(&no_openat2, memory_order_relaxed))
+    {
+        int fd = openat2_beneath(rel, RESOLVE_NO_SYMLINKS);
+        if (fd == -1 && errno == ELOOP)
+        {
+            *via_link = true;
+            fd = openat2_beneath(rel, RESOLVE_NO_MAGICLINKS);
+        }
+        if (fd != -1 || (errno != ENOSYS && errno != EXDEV))
+            return fd;
+        if (errno == ENOSYS)
+            atomic_store(&no_openat2, true);
+    }
+
+    *via_link = true;
+
+    char fname[PATH_MAX], real[PATH_MAX];
+    if (snprintf(fname, sizeof fname, "%s/%s", server_root, rel) >= sizeof fname)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (realpath(fname, real) == NULL)
+        return -1;
+    // the file must lie below the server root, also after following links
+    size_t rootlen = strlen(server_root);
+    if (strncmp(real, server_root, rootlen) || (real[rootlen] != '/' && real[rootlen] != '\0'))
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    return open(real, O_RDONLY | O_CLOEXEC);
+}
+
+/* Whether time 'a' is before time 'b'. */
+static bool older(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Open the sidecar of the file at 'rel' with the given suffix, if it
+ * is a regular file no older than the file itself. */
+static void open_sidecar(struct filecache_sidecar *sc, const char *rel, const char *suffix,
+                         const struct stat *file_st, bool *via_link)
+{
+    char name[PATH_MAX];
+    struct stat st;
+    sc->fd = -1;
+    if (snprintf(name, sizeof name, "%s%s", rel, suffix) >= sizeof name)
+        return;
+    int fd = open_beneath(name, via_link);
+    if (fd == -1)
+        return;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || older(&st.st_mtim, &file_st->st_mtim))
+    {
+        close(fd);
+        return;
+    }
+    sc->fd = fd;
+    sc->size = st.st_size;
+    format_etag(sc->etag, sizeof sc->etag, &st);
+    atomic_fetch_add(&open_fds, 1);
+}
+
+/* Open the file for request path 'path' and describe it.  'gen' is the
+ * cache's generation from before the file was opened, and *via_link is
+ * set, also on failure, if the path went through a symbolic link.
+ * Returns a new entry with one reference, or NULL with errno set. */
+static struct filecache_entry *open_entry(const char *path, uint32_t hash, unsigned gen,
+                                          bool *via_link)
+{
+    int fd = open_beneath(relative(path), via_link);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        close(fd);
+        errno = EISDIR;
+        return NULL;
+    }
+
+    const struct mime_type *mime = mimetypes_lookup(path);
+    char etag[48], last_modified[32];
+    format_etag(etag, sizeof etag, &st);
+    struct tm tm;
+    strftime(last_modified, sizeof last_modified, "%a, %d %b %Y %H:%M:%S GMT",
+             gmtime_r(&st.st_mtim.tv_sec, &tm));
+
+    struct filecache_sidecar sidecars[ENCODING_COUNT];
+    bool vary = compcache_compressible(mime, st.st_size);
+    for (int i = 0; i < ENCODING_COUNT; i++)
+    {
+        open_sidecar(&sidecars[i], relative(path), content_encoding_suffixes[i], &st, via_link);
+        vary |= sidecars[i].fd != -1;
+    }
+
+    char head[512];
+    size_t head_len = 0;
+    if (max_response_bytes > 0 && st.st_size <= RESPONSE_MAX)
+        head_len = http_render_file_head(head, sizeof head, mime, last_modified, vary,
+                                         st.st_size, etag, NULL);
+    // a response that does not fit in a shard's share would never be cached
+    if (head_len + 2 + st.st_size > max_shard_bytes)
+        head_len = 0;
+    // the response ends with the blank line and the body
+    size_t response_len = head_len > 0 ? head_len + 2 + st.st_size : 0;
+
+    size_t keylen = strlen(path) + 1;
+    struct filecache_entry *e = malloc(sizeof(*e) + keylen + response_len);
+    if (e == NULL)
+    {
+        perror("can't alloc memory: ");
+        exit(EXIT_FAILURE);
+    }
+    memset(e, 0, sizeof(*e));
+    char *strings = (char *) (e + 1);
+    e->key = memcpy(strings, path, keylen);
+    e->hash = hash;
+    e->fd = fd;
+    e->size = st.st_size;
+    e->mtime = st.st_mtim;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->mime = mime;
+    memcpy(e->etag, etag, sizeof etag);
+    memcpy(e->last_modified, last_modified, sizeof last_modified);
+    memcpy(e->sidecars, sidecars, sizeof sidecars);
+    e->vary = vary;
+    e->via_link = *via_link;
+    atomic_init(&e->refs, 1);
+    atomic_init(&e->checked, now());
+    atomic_init(&e->generation, gen);
+
+    if (response_len > 0)
+    {
+        char *response = strings + keylen;
+        memcpy(response, head, head_len);
+        memcpy(response + head_len, "\r\n", 2);
+        ssize_t n = 0, rc = 0;
+        while (n < st.st_size && (rc = pread(fd, response + head_len + 2 + n, st.st_size - n, n)) > 0)
+            n += rc;
+        // if the file shrank meanwhile, send it from the descriptor
+        if (n == st.st_size)
+        {
+            close(fd);
+            e->fd = -1;
+            e->response = response;
+            e->response_len = response_len;
+            e->response_head_len = head_len;
+            atomic_fetch_add(&response_bytes, response_len);
+        }
+    }
+    if (e->fd != -1)
+        atomic_fetch_add(&open_fds, 1);
+    return e;
+}
+
+/* Create an entry that records a failed lookup of 'path'. */
+static struct filecache_entry *negative_entry(const char *path, uint32_t hash, int error,
+                                              unsigned gen, bool via_link)
+{
+    size_t keylen = strlen(path) + 1;
+    struct filecache_entry *e = malloc(sizeof(*e) + keylen);
+    if (e == NULL)
+    {
+        perror("can't alloc memory: ");
+        exit(EXIT_FAILURE);
+    }
+    memset(e, 0, sizeof(*e));
+    e->key = memcpy(e + 1, path, keylen);
+    e->hash = hash;
+    e->error = error;
+    e->via_link = via_link;
+    e->fd = -1;
+    for (int i = 0; i < ENCODING_COUNT; i++)
+        e->sidecars[i].fd = -1;
+    atomic_init(&e->refs, 1);
+    atomic_init(&e->checked, now());
+    atomic_init(&e->generation, gen);
+    return e;
+}
+
+/* Hand an entry to the caller, or, for a negative entry, drop it and
+ * return NULL with errno set. */
+static struct filecache_entry *check_out(struct filecache_entry *e)
+{
+    if (e->error == 0)
+        return e;
+    int error = e->error;
+    filecache_put(e);
+    errno = error;
+    return NULL;
+}
+
+/* Check whether the file 'e' was opened from is still in place, unchanged,
+ * and its sidecars with it.
+ * This stat may follow links out of the root, but then finds a different
+ * file, which is opened afresh and checked.  A failed lookup is always
+ * retried. */
+static bool unchanged(struct filecache_entry *e)
+{
+    struct stat st;
+    if (e->error != 0 || fstatat(root_fd, relative(e->key), &st, 0) == -1 || st.st_dev != e->dev
+        || st.st_ino != e->ino || st.st_size != e->size || st.st_mtim.tv_sec != e->mtime.tv_sec
+        || st.st_mtim.tv_nsec != e->mtime.tv_nsec)
+        return false;
+    // a sidecar may be regenerated, added or removed on its own
+    for (int i = 0; i < ENCODING_COUNT; i++)
+    {
+        const struct filecache_sidecar *sc = &e->sidecars[i];
+        char name[PATH_MAX];
+        if (snprintf(name, sizeof name, "%s%s", relative(e->key), content_encoding_suffixes[i]) >= sizeof name)
+            continue;
+        bool usable = fstatat(root_fd, name, &st, 0) == 0 && S_ISREG(st.st_mode) && !older(&st.st_mtim, &e->mtime);
+        if (usable != (sc->fd != -1))
+            return false;
+        if (usable)
+        {
+            char etag[sizeof sc->etag];
+            format_etag(etag, sizeof etag, &st);
+            if (strcmp(etag, sc->etag))
+                return false;
+        }
+    }
+    return true;
+}
+
+/* Drop the entry for 'path', if there is one. */
+static void remove_path(const char *path)
+{
+    uint32_t hash = hash_path(path);
+    struct shard *s = &shards[(hash >> 24) % NSHARDS];
+    pthread_mutex_lock(&s->lock);
+    struct filecache_entry *e = lookup(s, path, hash);
+    if (e != NULL)
+    {
+        shard_remove(s, e);
+        compcache_forget(e);
+        filecache_put(e);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Apply the changes the watcher reported, unless another thread is
+ * doing so already. */
+static void drain_notifications(void)
+{
+    if (atomic_load_explicit(&notify_head, memory_order_relaxed)
+            == atomic_load_explicit(&notify_tail, memory_order_relaxed)
+        && !atomic_load_explicit(&notify_all, memory_order_relaxed))
+        return;
+    if (atomic_flag_test_and_set_explicit(&draining, memory_order_acquire))
+        return;
+
+    // the watcher is the only producer, and holding 'draining' makes this the only consumer
+    unsigned head = atomic_load_explicit(&notify_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&notify_tail, memory_order_acquire);
+    for (; head != tail; head++)
+    {
+        char *path = notify_ring[head % NOTIFY_SLOTS];
+        // count it first, so that a miss that opened the old file and
+        // finds no entry to remove yet still sees the change
+        atomic_fetch_add(&notify_seq, 1);
+        remove_path(path);
+        // a changed sidecar changes how its file is sent
+        for (int i = 0; i < ENCODING_COUNT; i++)
+        {
+            size_t len = strlen(path), slen = strlen(content_encoding_suffixes[i]);
+            if (len > slen && !strcmp(path + len - slen, content_encoding_suffixes[i]))
+            {
+                path[len - slen] = '\0';
+                remove_path(path);
+            }
+        }
+        free(path);
+    }
+    atomic_store_explicit(&notify_head, head, memory_order_release);
+    if (atomic_exchange(&notify_all, false))
+        atomic_fetch_add(&generation, 1);
+    atomic_flag_clear_explicit(&draining, memory_order_release);
+}
+
+/**
+ * Report that the file at a path changed, was replaced or was removed.
+ * Called by the watcher thread only; does not block.
+ * @param path The file's request path
+ */
+void filecache_invalidate(const char *path)
+{
+    unsigned tail = atomic_load_explicit(&notify_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&notify_head, memory_order_acquire);
+    char *copy = tail - head < NOTIFY_SLOTS ? strdup(path) : NULL;
+    if (copy == NULL)
+    {
+        filecache_invalidate_all();
+        return;
+    }
+    notify_ring[tail % NOTIFY_SLOTS] = copy;
+    atomic_store_explicit(&notify_tail, tail + 1, memory_order_release);
+}
+
+/**
+ * Have every cached file checked for changes before it is used again,
+ * as when a directory was moved or changes were lost.
+ */
+void filecache_invalidate_all(void)
+{
+    atomic_store_explicit(&notify_all, true, memory_order_release);
+}
+
+/**
+ * Tell whether changes are reported, so that the TTL need not be used.
+ * @param on true if the watcher covers the whole tree
+ */
+void filecache_set_watched(bool on)
+{
+    atomic_store(&watched, on);
+}
+
+/**
+ * Look up the file for a request path, opening and caching it on a miss.
+ * @param path The request path, normalised, relative to the server root
+ * @return The entry, to be released with filecache_put, or NULL with
+ *         errno set if the file cannot be served.  EISDIR reports a
+ *         directory, and ENOENT also a path that leads outside the root.
+ */
+struct filecache_entry *filecache_get(const char *path)
+{
+    uint32_t hash = hash_path(path);
+    struct shard *s = &shards[(hash >> 24) % NSHARDS];
+    struct filecache_entry *e = NULL;
+
+    if (max_shard_entries > 0)
+    {
+        drain_notifications();
+        pthread_mutex_lock(&s->lock);
+        e = lookup(s, path, hash);
+        if (e != NULL)
+        {
+            atomic_fetch_add(&e->refs, 1);
+            if (!e->pinned)
+            {
+                lru_unlink(e);
+                lru_push(s, e);
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (e != NULL)
+    {
+        time_t t = now();
+        unsigned gen = atomic_load(&generation);
+        bool fresh = atomic_load(&e->generation) == gen
+                     && ((atomic_load_explicit(&watched, memory_order_relaxed) && !e->via_link)
+                         || t - atomic_load(&e->checked) < ttl_seconds);
+        if (!fresh && unchanged(e))
+        {
+            atomic_store(&e->checked, t);
+            atomic_store(&e->generation, gen);
+            fresh = true;
+        }
+        if (fresh)
+        {
+            atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+            if (e->response != NULL)
+                atomic_fetch_add_explicit(&response_hits, 1, memory_order_relaxed);
+            if (e->error != 0)
+                atomic_fetch_add_explicit(&negative_hits, 1, memory_order_relaxed);
+            return check_out(e);
+        }
+        // the file changed; replace the entry
+        pthread_mutex_lock(&s->lock);
+        if (lookup(s, path, hash) == e)
+        {
+            shard_remove(s, e);
+            filecache_put(e);
+        }
+        pthread_mutex_unlock(&s->lock);
+        filecache_put(e);
+    }
+
+    atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+    unsigned seq = atomic_load(&notify_seq);
+    unsigned gen = atomic_load(&generation);
+    bool via_link = false;
+    e = open_entry(path, hash, gen, &via_link);
+    if (max_shard_entries == 0)
+        return e;
+    if (e == NULL)
+    {
+        if (errno != ENOENT && errno != ENOTDIR && errno != EISDIR)
+            return NULL;
+        e = negative_entry(path, hash, errno, gen, via_link);
+    }
+    // a change reported while the file was being opened may predate the
+    // open, or not; have the entry checked on its first hit
+    if (atomic_load(&notify_seq) != seq)
+        atomic_fetch_sub(&e->generation, 1);
+
+    pthread_mutex_lock(&s->lock);
+    struct filecache_entry *other = lookup(s, path, hash);
+    if (other != NULL)
+    {
+        // another thread cached the file meanwhile
+        atomic_fetch_add(&other->refs, 1);
+        pthread_mutex_unlock(&s->lock);
+        filecache_put(e);
+        return check_out(other);
+    }
+    e->pinned = pinned_path != NULL && e->error == 0 && !strcmp(path, pinned_path);
+    if (e->error != 0 && (s->nnegative >= max_shard_negative || over_limits(s, e)))
+    {
+        // negative entries only take room to spare and never cause an eviction
+        pthread_mutex_unlock(&s->lock);
+        return check_out(e);
+    }
+    while (!e->pinned && over_limits(s, e) && s->lru.lru_prev != &s->lru)
+    {
+        struct filecache_entry *victim = s->lru.lru_prev;
+        shard_remove(s, victim);
+        filecache_put(victim);
+    }
+    if (e->pinned || !over_limits(s, e))
+    {
+        struct filecache_entry **bucket = &s->buckets[hash & s->mask];
+        e->next = *bucket;
+        *bucket = e;
+        if (e->pinned)
+            e->lru_prev = e->lru_next = e;      // unlinking it changes nothing
+        else
+            lru_push(s, e);
+        s->nentries++;
+        if (e->error != 0)
+            s->nnegative++;
+        s->nfds += entry_fds(e);
+        s->nbytes += e->response_len;
+        atomic_fetch_add(&nentries, 1);
+        atomic_fetch_add(&e->refs, 1);      // the cache's reference
+    }
+    pthread_mutex_unlock(&s->lock);
+    return check_out(e);
+}
+
+/**
+ * Keep the file at a path cached for good, and load it now.  Call
+ * once, before the cache is used by more than one thread.
+ * @param path The request path, normalised
+ */
+void filecache_pin(const char *path)
+{
+    pinned_path = path;
+    struct filecache_entry *e = filecache_get(path);
+    if (e != NULL)
+        filecache_put(e);
+}
+
+/**
+ * Report how the cache is doing.
+ * @param st Filled with the counters and current usage
+ */
+void filecache_get_stats(struct filecache_stats *st)
+{
+    st->hits = atomic_load(&hits);
+    st->misses = atomic_load(&misses);
+    st->response_hits = atomic_load(&response_hits);
+    st->negative_hits = atomic_load(&negative_hits);
+    st->entries = atomic_load(&nentries);
+    st->fds = atomic_load(&open_fds);
+    st->response_bytes = atomic_load(&response_bytes);
+}
@@ -0,0 +1,74 @@
+#ifndef _FILECACHE_H
+#define _FILECACHE_H
+
+#include <sys/types.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "compcache.h"
+#include "mimetypes.h"
+
+/* A precompressed copy of a file, such as index.html.gz. */
+struct filecache_sidecar {
+    int fd;                         // -1 if there is none
+    off_t size;
+    char etag[48];
+};
+
+/*
+ * A cache of open static files, keyed by request path and shared by
+ * all threads.  An entry is reference counted: the cache holds one
+ * reference while the entry is in it, and every user holds one from
+ * filecache_get until filecache_put, so an entry that is evicted or
+ * replaced stays usable until its last user is done with it.
+ */
+struct filecache_entry {
+    int fd;                         // open for reading, or -1 if 'response' holds the file;
+                                    // shared, so use explicit offsets
+    off_t size;
+    struct timespec mtime;
+    const struct mime_type *mime;   // Content-Type to send
+    char etag[48];                  // strong validator, quoted
+    char last_modified[32];         // mtime as an HTTP-date
+    const char *response;           // the complete response, or NULL to send the file from fd
+    size_t response_len;
+    size_t response_head_len;       // the headers end here, before the blank line
+    struct filecache_sidecar sidecars[ENCODING_COUNT];
+    bool vary;                      // whether the file may be sent compressed
+    dev_t dev;                      // identity of the file, which may have several paths
+    ino_t ino;
+
+    // private to filecache.c
+    struct filecache_entry *next;   // in the hash chain
+    struct filecache_entry *lru_prev, *lru_next;
+    const char *key;
+    uint32_t hash;
+    bool via_link;                  // resolved through a symbolic link
+    bool pinned;                    // never evicted
+    int error;                      // errno of a failed lookup, which the entry records
+    atomic_int refs;
+    _Atomic time_t checked;         // when the file was last found unchanged
+    atomic_uint generation;         // of the cache, when last found unchanged
+};
+
+struct filecache_stats {
+    unsigned long hits;             // lookups answered from the cache
+    unsigned long misses;           // lookups that had to open the file
+    unsigned long response_hits;    // hits on an in-memory response
+    unsigned long negative_hits;    // hits on a failed lookup
+    int entries;
+    int fds;
+    long response_bytes;
+};
+
+void filecache_init(int max_entries, int max_fds, long max_bytes, int ttl);
+struct filecache_entry *filecache_get(const char *path);
+void filecache_put(struct filecache_entry *e);
+void filecache_get_stats(struct filecache_stats *st);
+void filecache_pin(const char *path);
+void filecache_invalidate(const char *path);
+void filecache_invalidate_all(void);
+void filecache_set_watched(bool on);
+
+#endif /* _FILECACHE_H */
@@ -6,11 +6,23 @@
 extern char *server_root;
 extern bool silent_mode;
 extern int token_expiration_time;
+extern int idle_timeout;
+extern int header_timeout;
+extern int body_timeout;
 extern bool html5_fallback;
 extern int accepting_socket;
+extern int evloop_threads;
+extern int bufio_capacity;
 
-extern int create_listen_thread(pthread_t *th, int listensocket);
+extern int create_listen_thread(pthread_t *th, int listensocket, int cpu);
+extern int pin_thread_to_cpu(pthread_t th, int cpu);
 extern char server_root_real[1024];
 extern void* do_http_handle(void *args);
+extern void serve_client(int sock);
+extern struct threadpool *worker_pool;
+extern int start_timeout_thread(void);
+#ifdef HAVE_IO_URING
+extern bool use_io_uring;
+#endif
 extern void* do_listen_and_accept(void* args);
 
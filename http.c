@@ -13,7 +13,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -29,6 +31,9 @@
 #include "socket.h"
 #include "bufio.h"
 #include "globals.h"
+#include "admission.h"
+#include "filecache.h"
+#include "compcache.h"
 
 // Need macros here because of the sizeof
 #define CRLF "\r\n"
@@ -41,68 +46,142 @@ char server_root_real[1024];
 const int MAX_HEADER_LEN = 2048;
 const int MAX_ERROR_LEN = 2048;
 
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
 /**
- * Check if the URL is valid
- * @param uri The url to be checked
- * @return return 0 if the URL is valid
+ * Decode and normalise a request path in place: drop the query, decode
+ * %XX escapes, and resolve repeated slashes and "." and ".." segments
+ * lexically.  A trailing slash is kept.
+ * @param path The request path, which is never lengthened
+ * @return 0, or -1 if the path is not absolute, has a malformed escape
+ *         or an encoded NUL, or climbs above the root
  */
-static int check_uri_valid(char *uri)
+static int normalize_path(char *path)
 {
-    char buff[1024];
-    char realuri[1024];
-    realuri[0] = 0;
-    strcat(realuri, server_root);
-    strcat(realuri, uri);
+    if (path[0] != '/')
+        return -1;
+    path[strcspn(path, "?#")] = '\0';
 
-    if (strcasecmp(uri, "/api/login") == 0)
+    char *w = path;
+    for (const char *r = path; *r != '\0'; r++)
     {
-        return 0;
+        if (*r != '%')
+        {
+            *w++ = *r;
+            continue;
+        }
+        int hi = hex_value(r[1]);
+        int lo = hi != -1 ? hex_value(r[2]) : -1;
+        if (lo == -1 || (hi | lo) == 0)
+            return -1;
+        *w++ = hi << 4 | lo;
+        r += 2;
     }
-    else if (strcasestr(uri, "..") != NULL)
+    *w = '\0';
+
+    // 'out' ends the normalised prefix, a sequence of "/segment"s, and
+    // never overtakes 'seg', so segments are moved down in place
+    char *out = path;
+    const char *seg = path;
+    bool dir = false;
+    while (*seg != '\0')
     {
-        return -1;
+        seg += strspn(seg, "/");
+        size_t len = strcspn(seg, "/");
+        dir = len == 0 || (len == 1 && seg[0] == '.');
+        if (len == 2 && seg[0] == '.' && seg[1] == '.')
+        {
+            if (out == path)
+                return -1;
+            do
+                out--;
+            while (*out != '/');
+            dir = true;
+        }
+        else if (!dir)
+        {
+            *out++ = '/';
+            memmove(out, seg, len);
+            out += len;
+        }
+        seg += len;
     }
-    else if (realpath(realuri, buff) == NULL)
+    if (out == path || dir)
+        *out++ = '/';
+    *out = '\0';
+    return 0;
+}
+
+/**
+ * Look up the file a URL names.  With the HTML5 fallback, a path
+ * outside the API that names no file, or a directory, gets /index.html.
+ * @param uri The url, normalised by normalize_path
+ * @param file Set to the file to serve, or NULL for the login and stats APIs
+ * @return return 0 if the URL is valid, -4 if its file may not be read
+ */
+static int check_uri_valid(char *uri, struct filecache_entry **file)
+{
+    *file = NULL;
+    if (strcasecmp(uri, "/api/login") == 0 || strcasecmp(uri, "/api/stats") == 0)
     {
-        return -2;
+        return 0;
     }
-    if (STARTS_WITH(buff, server_root))
+    *file = filecache_get(uri);
+    if (*file == NULL && html5_fallback && !STARTS_WITH(uri, "/api")
+        && (errno == ENOENT || errno == ENOTDIR || errno == EISDIR))
     {
-        return 0;
+        *file = filecache_get("/index.html");
     }
-    return -3;
+    if (*file == NULL)
+    {
+        return errno == EACCES ? -4 : -2;
+    }
+    return 0;
+}
+
+/* Return true if the span of 'base' equals the string 'str'. */
+static bool span_equals(const char *base, struct http_span span, const char *str)
+{
+    return span.len == strlen(str) && !memcmp(base + span.off, str, span.len);
 }
 
 /**
- * Pharse the header and save the information in a header
+ * Pharse the header and save the information in a header.
+ * The parser has already identified the header name.
  * @param ta The http_transaction structure to store information
- * @param field_name The header name
- * @param field_value The corresponding header value
+ * @param head_offset The offset of the request head in the client's bufio
+ * @param head The request head the header's spans refer to
+ * @param header The header's name and value
  * @return return 0 if saved successfully
  */
-static int http_parse_save_header_info(struct http_transaction *ta, char* field_name, char* field_value)
+static int http_parse_save_header_info(struct http_transaction *ta, size_t head_offset, char *head,
+                                       struct http_parser_header *header)
 {
-    int index = -1;
-    if (!strcasecmp(field_name, "Accept")) {
-        index = HTTP_HEADER_ACCEPT;
-    }
-    if (!strcasecmp(field_name, "Connection")) {
-        index = HTTP_HEADER_CONNECTION;
-    }
-    if (!strcasecmp(field_name, "Content-Type")) {
-        index = HTTP_HEADER_CONTENT_TYPE;
-    }
-    if (!strcasecmp(field_name, "Cookie")) {
-        index = HTTP_HEADER_COOKIE;
-    }
-
-    if (index != -1)
+    if (ta->req_headercnt == MAX_HEADER_NUM)
     {
-        ta->req_headernames[index] = calloc(1, strlen(field_name) + 1);
-        strcpy(ta->req_headernames[index], field_name);
-        ta->req_headervalues[index] = calloc(1, strlen(field_value) + 1);
-        strcpy(ta->req_headervalues[index], field_value);
+        return -1;
     }
+
+    // the ':' after the name and the whitespace or CR after the value
+    // are no longer needed, so both are terminated in place
+    head[header->name.off + header->name.len] = '\0';
+    head[header->value.off + header->value.len] = '\0';
+
+    struct http_header *h = &ta->req_headers[ta->req_headercnt++];
+    h->name = head_offset + header->name.off;
+    h->name_len = header->name.len;
+    h->value = head_offset + header->value.off;
+    h->value_len = header->value.len;
+    h->id = header->id;
     return 0;
 }
 
@@ -114,7 +193,35 @@ static int http_parse_save_header_info(struct http_transaction *ta, char* field_
  */
 static char* http_find_header_value(int header, struct http_transaction *ta)
 {
-    return ta->req_headervalues[header];
+    for (int i = 0; i < ta->req_headercnt; i++)
+    {
+        if (ta->req_headers[i].id == header)
+        {
+            return bufio_offset2ptr(ta->client->bufio, ta->req_headers[i].value);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find the value of any request header by its name
+ * @param ta The transaction whose request is searched
+ * @param name The header name, compared case-insensitively
+ * @return return the value of the first such header, or NULL
+ */
+char *http_get_header(struct http_transaction *ta, const char *name)
+{
+    size_t len = strlen(name);
+    for (int i = 0; i < ta->req_headercnt; i++)
+    {
+        struct http_header *h = &ta->req_headers[i];
+        if (h->name_len == len
+            && !strcasecmp(bufio_offset2ptr(ta->client->bufio, h->name), name))
+        {
+            return bufio_offset2ptr(ta->client->bufio, h->value);
+        }
+    }
+    return NULL;
 }
 
 /**
@@ -166,6 +273,71 @@ static bool check_user_valid(struct http_transaction *ta)
     return true;
 }
 
+/**
+ * Find the auth_token cookie among the cookies of a request
+ * @param ta The http_transaction structure that store the information
+ * @param token The buffer to copy the cookie's value into
+ * @param size The size of the buffer
+ * @return return true if the cookie is present and fits in the buffer
+ */
+static bool http_find_auth_token(struct http_transaction *ta, char *token, size_t size)
+{
+    static const char name[] = "auth_token=";
+    char *cookies = http_find_header_value(HTTP_HEADER_COOKIE, ta);
+    for (char *p = cookies; p != NULL && *p != '\0'; )
+    {
+        p += strspn(p, " ;");
+        size_t len = strcspn(p, ";");
+        if (len >= sizeof(name) - 1 && !strncmp(p, name, sizeof(name) - 1))
+        {
+            len -= sizeof(name) - 1;
+            if (len >= size)
+            {
+                return false;
+            }
+            memcpy(token, p + sizeof(name) - 1, len);
+            token[len] = '\0';
+            return true;
+        }
+        p += len;
+    }
+    return false;
+}
+
+/**
+ * Check the JWT in the auth_token cookie of a request
+ * @param ta The http_transaction structure that store the information
+ * @param validuser The parameter store the user name if the token is valid
+ * @return return HTTP_JWT_CHECK_RET_OK if the token is valid
+ */
+static int http_check_jwt_cookie_valid(struct http_transaction *ta, char *validuser)
+{
+    char exp[64];
+    jwt_item item;
+    memset(&item, 0, sizeof(item));
+
+    char token[sizeof(item.token)];
+    if (!http_find_auth_token(ta, token, sizeof(token)))
+    {
+        return HTTP_JWT_CHECK_RET_COOKIE_NOT_EXIST;    //cookie invalid
+    }
+
+    if (decode_jwt_token(ta->jwt, token, &item) < 0)
+    {
+        return HTTP_JWT_CHECK_RET_COOKIE_NG;     //cookie invalid
+    }
+
+    get_item_grant(&item, "exp", exp);
+    int t = atoi(exp);
+    int now = time(NULL);
+    if (now > t)
+    {
+        return HTTP_JWT_CHECK_RET_COOKIE_EXPIRED;   //token expired
+    }
+    strcpy(validuser, item.subname);
+    return HTTP_JWT_CHECK_RET_OK;
+}
+
 /**
  * Check if a request is valid
  * @param ta The http_transaction structure that store the information
@@ -174,34 +346,9 @@ static bool check_user_valid(struct http_transaction *ta)
  */
 static int http_check_jwt_req_valid(struct http_transaction *ta, char *validuser)
 {
-    char exp[64];
-
     if (ta->req_method == HTTP_GET)
     {
-        jwt_item item;
-        memset(&item, 0, sizeof(item));
-        char *cookiestr = http_find_header_value(HTTP_HEADER_COOKIE, ta);
-        if (cookiestr == NULL)
-        {
-            return HTTP_JWT_CHECK_RET_COOKIE_NOT_EXIST;    //cookie invalid
-        }
-        char *cookievalue = strchr(cookiestr, '=');
-        cookievalue++;
-
-        if (decode_jwt_token(ta->jwt, cookievalue, &item) < 0)
-        {
-            return HTTP_JWT_CHECK_RET_COOKIE_NG;     //cookie invalid
-        }
-
-        get_item_grant(&item, "exp", exp);
-        int t = atoi(exp);
-        int now = time(NULL);
-        if (now > t)
-        {
-            return HTTP_JWT_CHECK_RET_COOKIE_EXPIRED;   //token expired
-        }
-        strcpy(validuser, item.subname);
-        return HTTP_JWT_CHECK_RET_OK;
+        return http_check_jwt_cookie_valid(ta, validuser);
     }
 
     validuser[0] = 0;
@@ -225,7 +372,7 @@ static void http_put_globl_response_header(struct http_transaction *ta)
     {
         if (reqconnattr != NULL)
         {
-            if (!strcmp(ta->req_headervalues[HTTP_HEADER_CONNECTION], "close"))
+            if (!strcmp(reqconnattr, "close"))
             {
                 http_add_header(&ta->resp_headers, "Connection", "close");
             }
@@ -248,57 +395,25 @@ static void http_put_globl_response_header(struct http_transaction *ta)
     return;
 }
 
-/* Parse HTTP request line, setting req_method, req_path, and req_version. */
-static bool http_parse_request(struct http_transaction *ta)
+/* Set req_method, req_path, and req_version from the parsed request line. */
+static bool http_parse_request(struct http_transaction *ta, size_t head_offset, struct http_parser *parser)
 {
-    size_t req_offset;
-    ssize_t len = bufio_readline(ta->client->bufio, &req_offset);
-    if (len < 2 || len > 8192)       // error, EOF, or less than 2 characters
-    {
-        return false;
-    }
+    char *head = bufio_offset2ptr(ta->client->bufio, head_offset);
 
-    //fprintf(stderr, "req_offset: %d, len: %d\n", req_offset, len);
-
-    char *request = bufio_offset2ptr(ta->client->bufio, req_offset);
-    //fprintf(stderr, "%s\n", request);
-    char *endptr;
-    char *method = strtok_r(request, " ", &endptr);
-    if (method == NULL)
-    {
-        //fprintf(stderr, "http req method failed\n");
-        return false;
-    }
-
-    if (!strcmp(method, "GET"))
+    if (span_equals(head, parser->method, "GET"))
         ta->req_method = HTTP_GET;
-    else if (!strcmp(method, "POST"))
+    else if (span_equals(head, parser->method, "POST"))
         ta->req_method = HTTP_POST;
     else
         ta->req_method = HTTP_UNKNOWN;
 
-    char *req_path = strtok_r(NULL, " ", &endptr);
-    if (req_path == NULL)
-    {
-        //fprintf(stderr, "http req path failed\n");
-        return false;
-    }
+    // terminate the path in place; the space after it is no longer needed
+    ta->req_path = head_offset + parser->path.off;
+    head[parser->path.off + parser->path.len] = '\0';
 
-    ta->req_path = bufio_ptr2offset(ta->client->bufio, req_path);
-    if (ta->req_path == -1)
-    {
-        return false;
-    }
-    char *http_version = strtok_r(NULL, CRLF, &endptr);
-    if (http_version == NULL)  // would be HTTP 0.9
-    {
-        //fprintf(stderr, "http req version failed\n");
-        return false;
-    }
-
-    if (!strcmp(http_version, "HTTP/1.1"))
+    if (span_equals(head, parser->version, "HTTP/1.1"))
         ta->req_version = HTTP_1_1;
-    else if (!strcmp(http_version, "HTTP/1.0"))
+    else if (span_equals(head, parser->version, "HTTP/1.0"))
         ta->req_version = HTTP_1_0;
     else
     {
@@ -309,52 +424,25 @@ static bool http_parse_request(struct http_transaction *ta)
     return true;
 }
 
-/* Process HTTP headers. */
-static bool http_process_headers(struct http_transaction *ta)
+/* Process the parsed HTTP headers. */
+static bool http_process_headers(struct http_transaction *ta, size_t head_offset, struct http_parser *parser)
 {
-    for (;;)
-    {
-        size_t header_offset;
-        ssize_t len = bufio_readline(ta->client->bufio, &header_offset);
-        if (len <= 0)
-        {
-            return false;
-        }
-        char *header = bufio_offset2ptr(ta->client->bufio, header_offset);
-        if (len == 2 && STARTS_WITH(header, CRLF))       // empty CRLF
-        {
-            return true;
-        }
-        header[len - 2] = '\0';
-        /* Each header field consists of a name followed by a
-         * colon (":") and the field value. Field names are
-         * case-insensitive. The field value MAY be preceded by
-         * any amount of LWS, though a single SP is preferred.
-         */
-        char *endptr;
-        char *field_name = strtok_r(header, ":", &endptr);
-        if (field_name == NULL)
-            return false;
-
-        char *field_value = strtok_r(NULL, " \t", &endptr);    // skip leading & trailing OWS
-        if (field_value == NULL)
-            return false;
+    char *head = bufio_offset2ptr(ta->client->bufio, head_offset);
 
+    if (parser->content_length > 0)
+    {
+        ta->req_content_len = parser->content_length;
+    }
 
-        if (!strcasecmp(field_name, "Content-Length"))
-        {
-            ta->req_content_len = atoi(field_value);
-        }
-        else
+    for (int i = 0; i < parser->nheaders; i++)
+    {
+        if (http_parse_save_header_info(ta, head_offset, head, &parser->headers[i]) < 0)
         {
-            /* Handle other headers here. */
-            if (http_parse_save_header_info(ta, field_name, field_value) < 0)
-            {
-                fprintf(stderr, "Header save failed, %s\n", field_name);
-                return false;
-            }
+            fprintf(stderr, "Header save failed\n");
+            return false;
         }
     }
+    return true;
 }
 
 /* add a formatted header to the response buffer. */
@@ -380,65 +468,72 @@ static void add_content_length(buffer_t *res, size_t len)
     http_add_header(res, "Content-Length", "%ld", len);
 }
 
-/* start the response by writing the first line of the response
- * to the response buffer.  Used in send_response_header */
-static void start_response(struct http_transaction * ta, buffer_t *res, int http_version)
+/* add a file's pre-rendered content-type header. */
+static void add_content_type(buffer_t *res, const struct mime_type *mime)
 {
-    buffer_appends(res, "HTTP/1.1 ");
+    buffer_append(res, (void *) mime->header, mime->header_len);
+}
 
-    switch (ta->resp_status)
+/* Return the first line of the response, including its CRLF. */
+static const char *status_line(enum http_response_status status)
+{
+    switch (status)
     {
         case HTTP_OK:
-            buffer_appends(res, "200 OK");
-            break;
+            return "HTTP/1.1 200 OK" CRLF;
+        case HTTP_PARTIAL_CONTENT:
+            return "HTTP/1.1 206 Partial Content" CRLF;
+        case HTTP_NOT_MODIFIED:
+            return "HTTP/1.1 304 Not Modified" CRLF;
         case HTTP_BAD_REQUEST:
-            buffer_appends(res, "400 Bad Request");
-            break;
+            return "HTTP/1.1 400 Bad Request" CRLF;
         case HTTP_PERMISSION_DENIED:
-            buffer_appends(res, "403 Permission Denied");
-            break;
+            return "HTTP/1.1 403 Permission Denied" CRLF;
         case HTTP_NOT_FOUND:
-            buffer_appends(res, "404 Not Found");
-            break;
+            return "HTTP/1.1 404 Not Found" CRLF;
         case HTTP_METHOD_NOT_ALLOWED:
-            buffer_appends(res, "405 Method Not Allowed");
-            break;
+            return "HTTP/1.1 405 Method Not Allowed" CRLF;
         case HTTP_REQUEST_TIMEOUT:
-            buffer_appends(res, "408 Request Timeout");
-            break;
+            return "HTTP/1.1 408 Request Timeout" CRLF;
         case HTTP_REQUEST_TOO_LONG:
-            buffer_appends(res, "414 Request Too Long");
-            break;
+            return "HTTP/1.1 414 Request Too Long" CRLF;
+        case HTTP_RANGE_NOT_SATISFIABLE:
+            return "HTTP/1.1 416 Range Not Satisfiable" CRLF;
         case HTTP_NOT_IMPLEMENTED:
-            buffer_appends(res, "501 Not Implemented");
-            break;
+            return "HTTP/1.1 501 Not Implemented" CRLF;
         case HTTP_SERVICE_UNAVAILABLE:
-            buffer_appends(res, "503 Service Unavailable");
-            break;
+            return "HTTP/1.1 503 Service Unavailable" CRLF;
         case HTTP_INTERNAL_ERROR:
         default:
-            buffer_appends(res, "500 Internal Server Error");
-            break;
+            return "HTTP/1.1 500 Internal Server Error" CRLF;
     }
-    buffer_appends(res, CRLF);
 }
 
-/* Send response headers to client */
-static bool send_response_header(struct http_transaction *ta)
+/**
+ * Send the status line, the headers and, if given, the body of the
+ * response in a single gather write, so that a small response leaves
+ * in a single TCP segment.
+ * @param ta The transaction whose response is sent
+ * @param body The response body, or NULL if the body is sent separately
+ * @param more Whether more of the response (a file) follows; the kernel
+ *             then holds the data back to send it together with the file
+ * @return return true if everything was sent
+ */
+static bool send_response_head(struct http_transaction *ta, buffer_t *body, bool more)
 {
-    buffer_t response;
-    buffer_init(&response, 80);
-
-    start_response(ta, &response, ta->req_version);
-    if (bufio_sendbuffer(ta->client->bufio, &response) == -1)
-        return false;
-
+    const char *status = status_line(ta->resp_status);
     buffer_appends(&ta->resp_headers, CRLF);
-    if (bufio_sendbuffer(ta->client->bufio, &ta->resp_headers) == -1)
-        return false;
 
-    buffer_delete(&response);
-    return true;
+    struct iovec iov[3] = {
+        { .iov_base = (char *)status, .iov_len = strlen(status) },
+        { .iov_base = ta->resp_headers.buf, .iov_len = ta->resp_headers.len },
+    };
+    int iovcnt = 2;
+    if (body != NULL && body->len > 0)
+    {
+        iov[iovcnt++] = (struct iovec) { .iov_base = body->buf, .iov_len = body->len };
+    }
+    return bufio_sendv(ta->client->bufio, iov, iovcnt, more) != -1;
 }
 
 /* Send a full response to client with the content in resp_body. */
@@ -447,10 +542,7 @@ static bool send_response(struct http_transaction *ta)
     // add content-length.  All other headers must have already been set.
     add_content_length(&ta->resp_headers, ta->resp_body.len);
 
-    if (!send_response_header(ta))
-        return false;
-
-    return bufio_sendbuffer(ta->client->bufio, &ta->resp_body) != -1;
+    return send_response_head(ta, &ta->resp_body, false);
 }
 
 /* Send an error response. */
@@ -475,95 +567,432 @@ static bool send_not_found(struct http_transaction *ta)
                       bufio_offset2ptr(ta->client->bufio, ta->req_path));
 }
 
-/* A start at assigning an appropriate mime type.  Real-world
- * servers use more extensive lists such as /etc/mime.types
+/**
+ * Handle invalid URL
+ * @param ta The http_transaction structure to store the information
+ * @param retval The return valid indicates whether the URL is valid
+ */
+static void handle_uri_invalid(struct http_transaction *ta, int retval)
+{
+    if (retval == -4)
+    {
+        send_error(ta, HTTP_PERMISSION_DENIED, "Permission denied.");
+    }
+    else
+    {
+        send_not_found(ta);
+    }
+}
+
+/**
+ * Render the headers of a response that sends a whole file, except
+ * for the per-request Connection header and the final blank line.
+ * @param buf Where to store the headers
+ * @param size The size of buf
+ * @param mime The file's Content-Type
+ * @param last_modified The file's Last-Modified date
+ * @param vary Whether the file may also be sent with another content coding
+ * @param length The size of the body
+ * @param etag The ETag of the body
+ * @param encoding The body's content coding, or NULL if it is the file as is
+ * @return The length of the headers, or 0 if they do not fit
  */
-static const char *guess_mime_type(char *filename)
+size_t http_render_file_head(char *buf, size_t size, const struct mime_type *mime, const char *last_modified,
+                             bool vary, off_t length, const char *etag, const char *encoding)
+{
+    int len = snprintf(buf, size, "%sServer: CS3214-Personal-Server" CRLF
+                       "Content-Length: %ld" CRLF "%s"
+                       "ETag: %s" CRLF "Last-Modified: %s" CRLF "Accept-Ranges: bytes" CRLF
+                       "%s%s%s%s",
+                       status_line(HTTP_OK), (long) length, mime->header, etag, last_modified,
+                       encoding != NULL ? "Content-Encoding: " : "", encoding != NULL ? encoding : "",
+                       encoding != NULL ? CRLF : "", vary ? "Vary: Accept-Encoding" CRLF : "");
+    return len > 0 && len < size ? len : 0;
+}
+
+/* Check whether the If-None-Match list 'header' names 'etag'.  The
+ * comparison is weak, as RFC 7232 requires for If-None-Match. */
+static bool etag_listed(const char *header, const char *etag)
 {
-    char *suffix = strrchr(filename, '.');
-    if (suffix == NULL)
-        return "text/plain";
+    size_t etag_len = strlen(etag);
+    const char *p = header;
+    for (;;)
+    {
+        p += strspn(p, " \t,");
+        if (*p == '\0')
+            return false;
+        if (*p == '*')
+            return true;
+        if (!strncmp(p, "W/", 2))
+            p += 2;
+        size_t len = strcspn(p, " \t,");
+        if (len == etag_len && !memcmp(p, etag, len))
+            return true;
+        p += len;
+    }
+}
 
-    if (!strcasecmp(suffix, ".html"))
-        return "text/html";
+/**
+ * Check whether a conditional GET can be answered with 304, because
+ * the client's copy of the file is current.  If-None-Match takes
+ * precedence over If-Modified-Since.
+ * @param ta The transaction whose request headers are checked
+ * @param file The requested file
+ * @param etag The ETag of the representation that would be sent
+ * @return true if the file was not modified
+ */
+static bool is_not_modified(struct http_transaction *ta, struct filecache_entry *file, const char *etag)
+{
+    if (ta->req_method != HTTP_GET)
+        return false;
 
-    if (!strcasecmp(suffix, ".gif"))
-        return "image/gif";
+    char *if_none_match = http_find_header_value(HTTP_HEADER_IF_NONE_MATCH, ta);
+    if (if_none_match != NULL)
+        return etag_listed(if_none_match, etag);
 
-    if (!strcasecmp(suffix, ".png"))
-        return "image/png";
+    char *if_modified_since = http_find_header_value(HTTP_HEADER_IF_MODIFIED_SINCE, ta);
+    if (if_modified_since == NULL)
+        return false;
+    struct tm tm = { 0 };
+    char *end = strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0')
+        return false;       // an invalid date is ignored
+    return file->mtime.tv_sec <= timegm(&tm);
+}
 
-    if (!strcasecmp(suffix, ".jpg"))
-        return "image/jpeg";
+/* More ranges than this in one request are not worth the parts' overhead. */
+#define MAX_RANGES 16
 
-    if (!strcasecmp(suffix, ".js"))
-        return "text/javascript";
+struct byte_range {
+    off_t first, last;      // inclusive
+};
 
-    return "text/plain";
+/* Parse a non-negative decimal number at *p, advancing *p past it.
+ * Returns -1 if there is none. */
+static off_t parse_offset(const char **p)
+{
+    if (**p < '0' || **p > '9')
+        return -1;
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(*p, &end, 10);
+    if (errno == ERANGE || n > INT64_MAX)
+        return -1;
+    *p = end;
+    return n;
 }
 
 /**
- * Handle invalid URL
- * @param ta The http_transaction structure to store the information
- * @param retval The return valid indicates whether the URL is valid
+ * Parse the Range header of a request for a file.
+ * @param header The value of the Range header
+ * @param size The size of the file
+ * @param ranges Filled with the satisfiable ranges, in request order
+ * @return The number of satisfiable ranges, which may be 0, or -1 if the
+ *         header is malformed or asks for too many ranges and must be ignored
  */
-static void handle_uri_invalid(struct http_transaction *ta, int retval)
+static int parse_range(const char *header, off_t size, struct byte_range *ranges)
 {
-    if (retval == -1)
+    if (strncasecmp(header, "bytes=", 6))
+        return -1;
+    const char *p = header + 6;
+    int nspecs = 0, nranges = 0;
+    for (;;)
     {
-        send_not_found(ta);
+        p += strspn(p, " \t");
+        off_t first = -1, last = -1;
+        if (*p == '-')
+        {
+            // the final n bytes
+            p++;
+            off_t n = parse_offset(&p);
+            if (n == -1)
+                return -1;
+            if (n > 0 && size > 0)
+            {
+                first = n < size ? size - n : 0;
+                last = size - 1;
+            }
+        }
+        else
+        {
+            first = parse_offset(&p);
+            if (first == -1 || *p++ != '-')
+                return -1;
+            if (*p >= '0' && *p <= '9')
+            {
+                last = parse_offset(&p);
+                if (last == -1 || last < first)
+                    return -1;
+            }
+            else
+            {
+                last = size - 1;
+            }
+            if (first >= size)
+                first = -1;
+            else if (last >= size)
+                last = size - 1;
+        }
+        if (++nspecs > MAX_RANGES)
+            return -1;
+        if (first != -1)
+            ranges[nranges++] = (struct byte_range) { first, last };
+
+        p += strspn(p, " \t");
+        if (*p == '\0')
+            return nranges;
+        if (*p++ != ',')
+            return -1;
     }
-    else
+}
+
+/* Check an If-Range precondition: the range is only wanted if the client's
+ * copy is current.  An ETag must match strongly, a date exactly. */
+static bool if_range_holds(struct http_transaction *ta, struct filecache_entry *file)
+{
+    char *if_range = http_find_header_value(HTTP_HEADER_IF_RANGE, ta);
+    if (if_range == NULL)
+        return true;
+    if (if_range[0] == '"')
+        return !strcmp(if_range, file->etag);
+    return !strcmp(if_range, file->last_modified);
+}
+
+/* Send bytes [off, off + len) of a file. */
+static bool send_file_data(struct http_transaction *ta, struct filecache_entry *file,
+                           off_t off, size_t len, bool more)
+{
+    if (file->response != NULL)
     {
-        send_not_found(ta);
+        // the body follows the headers and the blank line
+        struct iovec iov = {
+            .iov_base = (char *)file->response + file->response_head_len + 2 + off,
+            .iov_len = len
+        };
+        return bufio_sendv(ta->client->bufio, &iov, 1, more) != -1;
     }
+    return bufio_sendfile(ta->client->bufio, file->fd, &off, len) == len;
 }
 
-/* Handle HTTP transaction for static files. */
-static bool handle_static_asset(struct http_transaction *ta, char *basedir)
+/* Render the headers of one part of a multipart/byteranges body. */
+static int render_part_head(char *buf, size_t size, const char *boundary,
+                            struct filecache_entry *file, struct byte_range *r)
 {
-    char fname[PATH_MAX];
+    return snprintf(buf, size, CRLF "--%s" CRLF "%s"
+                    "Content-Range: bytes %lld-%lld/%lld" CRLF CRLF, boundary, file->mime->header,
+                    (long long) r->first, (long long) r->last, (long long) file->size);
+}
 
-    char *req_path = bufio_offset2ptr(ta->client->bufio, ta->req_path);
-    // The code below is vulnerable to an attack.  Can you see
-    // which?  Fix it to avoid indirect object reference (IDOR) attacks.
-    snprintf(fname, sizeof fname, "%s%s", basedir, req_path);
+/**
+ * Send a 206 response with the given ranges of a file: the range itself
+ * if there is one, or else a multipart/byteranges body with one part
+ * per range.
+ * @param ta The transaction
+ * @param file The requested file
+ * @param ranges The ranges to send, all satisfiable
+ * @param nranges The number of ranges, at least 1
+ * @return true if everything was sent
+ */
+static bool send_ranges(struct http_transaction *ta, struct filecache_entry *file,
+                        struct byte_range *ranges, int nranges)
+{
+    ta->resp_status = HTTP_PARTIAL_CONTENT;
+    http_add_header(&ta->resp_headers, "ETag", "%s", file->etag);
+    http_add_header(&ta->resp_headers, "Last-Modified", "%s", file->last_modified);
+    http_add_header(&ta->resp_headers, "Accept-Ranges", "bytes");
+    if (file->vary)
+        http_add_header(&ta->resp_headers, "Vary", "Accept-Encoding");
+
+    if (nranges == 1)
+    {
+        size_t len = ranges[0].last - ranges[0].first + 1;
+        add_content_length(&ta->resp_headers, len);
+        add_content_type(&ta->resp_headers, file->mime);
+        http_add_header(&ta->resp_headers, "Content-Range", "bytes %lld-%lld/%lld",
+                        (long long) ranges[0].first, (long long) ranges[0].last,
+                        (long long) file->size);
+        return send_response_head(ta, NULL, true)
+               && send_file_data(ta, file, ranges[0].first, len, false);
+    }
 
-    if (access(fname, R_OK))
+    // derived from the ETag, so that it is unlikely to occur in the file
+    char boundary[64];
+    snprintf(boundary, sizeof boundary, "byteranges_%.*s", (int) strlen(file->etag) - 2, file->etag + 1);
+    char part[512];
+    size_t total = 0;
+    for (int i = 0; i < nranges; i++)
+        total += render_part_head(part, sizeof part, boundary, file, &ranges[i])
+                 + ranges[i].last - ranges[i].first + 1;
+    total += strlen(CRLF "--" "--" CRLF) + strlen(boundary);
+
+    add_content_length(&ta->resp_headers, total);
+    http_add_header(&ta->resp_headers, "Content-Type", "multipart/byteranges; boundary=%s", boundary);
+    if (!send_response_head(ta, NULL, true))
+        return false;
+    for (int i = 0; i < nranges; i++)
     {
-        if (errno == EACCES)
-            return send_error(ta, HTTP_PERMISSION_DENIED, "Permission denied.");
-        else
-            return send_not_found(ta);
+        struct iovec iov = {
+            .iov_base = part,
+            .iov_len = render_part_head(part, sizeof part, boundary, file, &ranges[i])
+        };
+        if (bufio_sendv(ta->client->bufio, &iov, 1, true) == -1
+            || !send_file_data(ta, file, ranges[i].first, ranges[i].last - ranges[i].first + 1, true))
+            return false;
     }
+    int len = snprintf(part, sizeof part, CRLF "--%s--" CRLF, boundary);
+    struct iovec iov = { .iov_base = part, .iov_len = len };
+    return bufio_sendv(ta->client->bufio, &iov, 1, false) != -1;
+}
 
-    // Determine file size
-    struct stat st;
-    int rc = stat(fname, &st);
-    if (rc == -1)
+/* Send a pre-rendered response, with the Connection header, which is
+ * the only part that differs between requests, spliced in. */
+static bool send_prerendered(struct http_transaction *ta, const char *response,
+                             size_t response_len, size_t head_len)
+{
+    const char *connection = ta->IsKeepAlive ? "Connection: keep-alive" CRLF
+                                             : "Connection: close" CRLF;
+    struct iovec iov[3] = {
+        { .iov_base = (char *)response, .iov_len = head_len },
+        { .iov_base = (char *)connection, .iov_len = strlen(connection) },
+        { .iov_base = (char *)response + head_len, .iov_len = response_len - head_len },
+    };
+    return bufio_sendv(ta->client->bufio, iov, 3, false) != -1;
+}
+
+/* Send a file, or its precompressed sidecar, with a 200 response. */
+static bool send_whole_file(struct http_transaction *ta, struct filecache_entry *file,
+                            enum content_encoding encoding)
+{
+    if (encoding == ENCODING_IDENTITY && file->response != NULL)
+        return send_prerendered(ta, file->response, file->response_len, file->response_head_len);
+
+    struct filecache_sidecar *sidecar = encoding != ENCODING_IDENTITY ? &file->sidecars[encoding] : NULL;
+    off_t size = sidecar != NULL ? sidecar->size : file->size;
+    ta->resp_status = HTTP_OK;
+    add_content_length(&ta->resp_headers, size);
+    add_content_type(&ta->resp_headers, file->mime);
+    http_add_header(&ta->resp_headers, "ETag", "%s", sidecar != NULL ? sidecar->etag : file->etag);
+    http_add_header(&ta->resp_headers, "Last-Modified", "%s", file->last_modified);
+    http_add_header(&ta->resp_headers, "Accept-Ranges", "bytes");
+    if (sidecar != NULL)
+        http_add_header(&ta->resp_headers, "Content-Encoding", "%s", content_encoding_names[encoding]);
+    if (file->vary)
+        http_add_header(&ta->resp_headers, "Vary", "Accept-Encoding");
+
+    if (!send_response_head(ta, NULL, size > 0))
+        return false;
+    if (sidecar == NULL)
+        return send_file_data(ta, file, 0, size, false);
+    off_t pos = 0;
+    return bufio_sendfile(ta->client->bufio, sidecar->fd, &pos, size) == size;
+}
+
+/* Handle HTTP transaction for static files.  The file was looked up
+ * by check_uri_valid, so serving it takes no path resolution.
+ * A file is sent compressed if the client accepts it: from a sidecar
+ * if there is one, or else compressed on the fly.  Ranges always refer
+ * to the uncompressed file. */
+static bool handle_static_asset(struct http_transaction *ta, struct filecache_entry *file)
+{
+    struct byte_range ranges[MAX_RANGES];
+    int nranges = -1;
+    char *range = http_find_header_value(HTTP_HEADER_RANGE, ta);
+    if (range != NULL && ta->req_method == HTTP_GET && if_range_holds(ta, file))
     {
-        send_error(ta, HTTP_INTERNAL_ERROR, "Could not stat file.");
-        return rc;
+        // a malformed Range header is ignored
+        nranges = parse_range(range, file->size, ranges);
     }
-    int filefd = open(fname, O_RDONLY);
-    if (filefd == -1)
+
+    enum content_encoding encoding = ENCODING_IDENTITY;
+    struct compressed *compressed = NULL;
+    const char *etag = file->etag;
+    char *accept = file->vary && nranges < 0
+                   ? http_find_header_value(HTTP_HEADER_ACCEPT_ENCODING, ta) : NULL;
+    if (accept != NULL)
     {
-        send_not_found(ta);
-        return rc;
+        unsigned accepted = compcache_accepted(accept);
+        for (int i = 0; i < ENCODING_COUNT && encoding == ENCODING_IDENTITY; i++)
+        {
+            if ((accepted & (1u << i)) && file->sidecars[i].fd != -1)
+                encoding = i;
+        }
+        if (encoding != ENCODING_IDENTITY)
+        {
+            etag = file->sidecars[encoding].etag;
+        }
+        else if ((accepted & (1u << ENCODING_GZIP)) && compcache_compressible(file->mime, file->size))
+        {
+            compressed = compcache_get(file);
+            if (compressed != NULL && compressed->response == NULL)
+            {
+                compcache_put(compressed);
+                compressed = NULL;
+            }
+            if (compressed != NULL)
+                etag = compressed->etag;
+        }
     }
 
-    ta->resp_status = HTTP_OK;
-    add_content_length(&ta->resp_headers, st.st_size);
-    http_add_header(&ta->resp_headers, "Content-Type", "%s", guess_mime_type(fname));
+    bool rc;
+    if (is_not_modified(ta, file, etag))
+    {
+        ta->resp_status = HTTP_NOT_MODIFIED;
+        http_add_header(&ta->resp_headers, "ETag", "%s", etag);
+        http_add_header(&ta->resp_headers, "Last-Modified", "%s", file->last_modified);
+        if (file->vary)
+            http_add_header(&ta->resp_headers, "Vary", "Accept-Encoding");
+        rc = send_response_head(ta, NULL, false);
+    }
+    else if (nranges == 0)
+    {
+        ta->resp_status = HTTP_RANGE_NOT_SATISFIABLE;
+        http_add_header(&ta->resp_headers, "Content-Range", "bytes */%lld", (long long) file->size);
+        add_content_length(&ta->resp_headers, 0);
+        rc = send_response_head(ta, NULL, false);
+    }
+    else if (nranges > 0)
+    {
+        rc = send_ranges(ta, file, ranges, nranges);
+    }
+    else if (compressed != NULL)
+    {
+        rc = send_prerendered(ta, compressed->response, compressed->response_len,
+                              compressed->response_head_len);
+    }
+    else
+    {
+        rc = send_whole_file(ta, file, encoding);
+    }
 
-    bool success = send_response_header(ta);
-    if (!success)
-        goto out;
+    if (compressed != NULL)
+        compcache_put(compressed);
+    return rc;
+}
 
-    success = bufio_sendfile(ta->client->bufio, filefd, NULL, st.st_size) == st.st_size;
-    out:
-    close(filefd);
-    return success;
+/**
+ * Report the counters of the file and compression caches as JSON.
+ * Only sent to clients with a valid auth token.
+ * @param ta The http_transaction structure store the transaction information
+ * @return return true if handled successfully otherwise return false
+ */
+static bool handle_stats(struct http_transaction *ta)
+{
+    struct filecache_stats st;
+    struct compcache_stats cst;
+    filecache_get_stats(&st);
+    compcache_get_stats(&cst);
+
+    char json[512];
+    snprintf(json, sizeof json,
+             "{\"filecache\":{\"hits\":%lu,\"misses\":%lu,\"response_hits\":%lu,\"negative_hits\":%lu,"
+             "\"entries\":%d,\"fds\":%d,\"response_bytes\":%ld},"
+             "\"compcache\":{\"hits\":%lu,\"misses\":%lu,\"entries\":%d,\"bytes\":%ld}}",
+             st.hits, st.misses, st.response_hits, st.negative_hits, st.entries, st.fds, st.response_bytes,
+             cst.hits, cst.misses, cst.entries, cst.bytes);
+    http_add_header(&ta->resp_headers, "Content-Type", "application/json");
+    ta->resp_status = HTTP_OK;
+    buffer_appends(&ta->resp_body, json);
+    return send_response(ta);
 }
 
 /**
@@ -613,7 +1042,7 @@ static bool handle_api(struct http_transaction *ta, char * req_path)
         if (isuserok == true)
         {
             time_t t = time(NULL);
-            jwt_item *it = gen_new_jwt_token(ta->jwt, "user0", t, t + token_expiration_time);
+            jwt_item *it = gen_new_jwt_token(ta->jwt, &ta->arena, "user0", t, t + token_expiration_time);
             save_jwt_token(ta->jwt, it);
             http_gen_cookie_string("/", "auth_token", it->token, "3600", buff);
             http_add_header(&ta->resp_headers, "Set-Cookie", buff);
@@ -636,6 +1065,186 @@ static bool handle_api(struct http_transaction *ta, char * req_path)
 void http_setup_client(struct http_client *self, struct bufio *bufio)
 {
     self->bufio = bufio;
+    http_parser_init(&self->parser);
+    self->phase = HTTP_PHASE_BUSY;
+    self->wheel = NULL;
+    self->wheel_lock = NULL;
+    atomic_init(&self->timed_out, false);
+}
+
+/**
+ * Default action when a client misses a deadline.  Shutting down the
+ * receiving side wakes up a thread blocked reading from the client;
+ * the thread then finds timed_out set and gives up on the connection.
+ * @param deadline The client's deadline timer
+ */
+static void http_client_expired(struct timer *deadline)
+{
+    struct http_client *self = (struct http_client *)
+        ((char *)deadline - offsetof(struct http_client, deadline));
+
+    self->expired_phase = self->phase;
+    atomic_store(&self->timed_out, true);
+    shutdown(bufio_socket(self->bufio), SHUT_RD);
+}
+
+/**
+ * Enforce idle, header and body deadlines on a client.
+ * The deadline timer's function may be replaced after this call.
+ * @param self The client
+ * @param wheel The timing wheel driving the deadlines
+ * @param lock The lock protecting the wheel, or NULL if only this thread uses it
+ */
+void http_client_set_timeouts(struct http_client *self, struct timerwheel *wheel, pthread_mutex_t *lock)
+{
+    self->wheel = wheel;
+    self->wheel_lock = lock;
+    timer_init(&self->deadline, http_client_expired);
+}
+
+/**
+ * Move a client to a new phase, arming the deadline that goes with it.
+ * Staying in the same phase keeps the running deadline, so that e.g.
+ * the header deadline counts from the first byte of the request.
+ * @param self The client
+ * @param phase The new phase
+ */
+void http_client_set_phase(struct http_client *self, enum http_client_phase phase)
+{
+    if (self->wheel == NULL || self->phase == phase)
+    {
+        self->phase = phase;
+        return;
+    }
+
+    int timeout = 0;
+    switch (phase)
+    {
+        case HTTP_PHASE_IDLE:
+            timeout = idle_timeout;
+            break;
+        case HTTP_PHASE_HEADER:
+            timeout = header_timeout;
+            break;
+        case HTTP_PHASE_BODY:
+            timeout = body_timeout;
+            break;
+        case HTTP_PHASE_WRITE:
+            // a client that reads nothing of its response is as good as idle
+            timeout = idle_timeout;
+            break;
+        case HTTP_PHASE_BUSY:
+            break;
+    }
+
+    if (self->wheel_lock != NULL)
+        pthread_mutex_lock(self->wheel_lock);
+    self->phase = phase;
+    if (timeout > 0)
+        timer_arm(self->wheel, &self->deadline,
+                  timerwheel_clock() + (uint64_t)timeout * 1000 / TIMERWHEEL_TICK_MS);
+    else
+        timer_cancel(&self->deadline);
+    if (self->wheel_lock != NULL)
+        pthread_mutex_unlock(self->wheel_lock);
+}
+
+/**
+ * Send a 408 Request Timeout response, asking the client to close the connection.
+ * @param self The client
+ * @return return true if the response was sent
+ */
+bool http_send_request_timeout(struct http_client *self)
+{
+    static char timeout_response[] =
+        "HTTP/1.1 408 Request Timeout\r\n"
+        "Server: CS3214-Personal-Server\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n";
+    buffer_t resp = {
+        .buf = timeout_response,
+        .len = sizeof(timeout_response) - 1,
+        .cap = sizeof(timeout_response)
+    };
+    return bufio_sendbuffer(self->bufio, &resp) != -1;
+}
+
+/**
+ * Send a 431 or 413 response, asking the client to close the connection,
+ * when a request does not fit into a fixed-capacity bufio.
+ * @param self The client
+ * @param head_complete Whether the request line and headers fit, i.e., the body did not
+ * @return return true if the response was sent
+ */
+bool http_send_request_too_large(struct http_client *self, bool head_complete)
+{
+    static char head_response[] =
+        "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+        "Server: CS3214-Personal-Server\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n";
+    static char body_response[] =
+        "HTTP/1.1 413 Content Too Large\r\n"
+        "Server: CS3214-Personal-Server\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n";
+    char *response = head_complete ? body_response : head_response;
+    buffer_t resp = {
+        .buf = response,
+        .len = strlen(response),
+        .cap = strlen(response) + 1
+    };
+    return bufio_sendbuffer(self->bufio, &resp) != -1;
+}
+
+/**
+ * Called when reading a request failed.  If the failure was caused by a
+ * missed header or body deadline, tell the client with a 408; if the
+ * request did not fit into the connection's buffer, with a 431 or 413.
+ * @param self The client
+ * @return return false, to be passed on as the transaction's result
+ */
+static bool http_read_failed(struct http_client *self)
+{
+    if (atomic_load(&self->timed_out) &&
+        (self->expired_phase == HTTP_PHASE_HEADER || self->expired_phase == HTTP_PHASE_BODY))
+    {
+        http_send_request_timeout(self);
+    }
+    else if (bufio_full(self->bufio))
+    {
+        http_send_request_too_large(self, self->phase == HTTP_PHASE_BODY);
+    }
+    return false;
+}
+
+/**
+ * Check whether a complete request, including its body, is buffered.
+ * The event loop uses this to only call http_handle_transaction once
+ * the transaction can run without blocking on the socket.
+ * @param self The client whose buffered bytes are inspected
+ * @param head_complete Set to whether the request line and headers are buffered
+ * @return 1 if a full request is buffered, 0 if more data is needed,
+ *         -1 if the buffered data can never form a valid request
+ */
+int http_request_ready(struct http_client *self, bool *head_complete)
+{
+    size_t len;
+    char *data = bufio_unread(self->bufio, &len);
+
+    // resumes where the previous call stopped
+    enum http_parser_result rc = http_parser_execute(&self->parser, data, len);
+    *head_complete = rc == HTTP_PARSER_DONE;
+    if (rc != HTTP_PARSER_DONE)
+    {
+        return rc == HTTP_PARSER_ERROR ? -1 : 0;
+    }
+
+    long content_len = self->parser.content_length > 0 ? self->parser.content_length : 0;
+    return len - self->parser.head_len >= content_len ? 1 : 0;
 }
 
 /* Handle a single HTTP transaction.  Returns true on success. */
@@ -643,25 +1252,49 @@ bool http_handle_transaction(struct http_transaction *ta, struct http_client *se
 {
     ta->client = self;
 
+    /* Parse the request head, reading more of it as long as it is
+     * incomplete.  If the event loop checked for a complete request
+     * with http_request_ready, the parser is done already. */
+    struct http_parser *parser = &self->parser;
+    size_t unread;
+    char *data = bufio_unread(self->bufio, &unread);
+    http_client_set_phase(self, unread > 0 ? HTTP_PHASE_HEADER : HTTP_PHASE_IDLE);
+    enum http_parser_result prc;
+    while ((prc = http_parser_execute(parser, data, unread)) == HTTP_PARSER_AGAIN)
+    {
+        if (bufio_read_more(self->bufio) <= 0)
+            return http_read_failed(self);
+        http_client_set_phase(self, HTTP_PHASE_HEADER);
+        data = bufio_unread(self->bufio, &unread);
+    }
+    if (prc == HTTP_PARSER_ERROR)
+        return false;
+
+    size_t head_offset;
+    bufio_read(self->bufio, parser->head_len, &head_offset);
 
-    if (!http_parse_request(ta))
+    if (!http_parse_request(ta, head_offset, parser))
         return false;
 
 
-    if (!http_process_headers(ta))
+    if (!http_process_headers(ta, head_offset, parser))
         return false;
 
+    http_parser_init(parser);
+
 
     if (ta->req_content_len > 0)
     {
+        http_client_set_phase(self, HTTP_PHASE_BODY);
         int rc = bufio_read(self->bufio, ta->req_content_len, &ta->req_body);
         if (rc != ta->req_content_len)
         {
             fprintf(stderr, "Http req body read failed\n");
-            return false;
+            return http_read_failed(self);
         }
 
     }
+    http_client_set_phase(self, HTTP_PHASE_BUSY);
 
 
     buffer_init(&ta->resp_headers, 1024);
@@ -677,6 +1310,27 @@ bool http_handle_transaction(struct http_transaction *ta, struct http_client *se
         return false;
     }
 
+    // normalise the path once, so that admission and the checks for
+    // private content all see the path that is served
+    int urlcheckret = normalize_path(req_path);
+
+    // requests with a valid token for private content are served first under load
+    char user[256];
+    int token = HTTP_JWT_CHECK_RET_COOKIE_NOT_EXIST;
+    if (urlcheckret == 0 && (STARTS_WITH(req_path, "/private") || STARTS_WITH(req_path, "/api")))
+    {
+        token = http_check_jwt_cookie_valid(ta, user);
+    }
+    bool priority = token == HTTP_JWT_CHECK_RET_OK;
+    if (!admission_txn_begin(priority))
+    {
+        ta->IsKeepAlive = 0;
+        admission_send_unavailable(ta->client->bufio);
+        buffer_delete(&ta->resp_headers);
+        buffer_delete(&ta->resp_body);
+        return false;
+    }
+
     bool rc = false;
     if (ta->req_method == HTTP_UNKNOWN)
     {
@@ -685,7 +1339,11 @@ bool http_handle_transaction(struct http_transaction *ta, struct http_client *se
     }
 
 
-    int urlcheckret = check_uri_valid(req_path);
+    struct filecache_entry *file = NULL;
+    if (urlcheckret == 0)
+    {
+        urlcheckret = check_uri_valid(req_path, &file);
+    }
     if (urlcheckret < 0)
     {
         handle_uri_invalid(ta, urlcheckret);
@@ -695,11 +1353,22 @@ bool http_handle_transaction(struct http_transaction *ta, struct http_client *se
     {
         rc = handle_api(ta, req_path);
     }
+    else if (strcasecmp(req_path, "/api/stats") == 0)
+    {
+        // the counters reveal what is being served, so they are as private as /private
+        if (token != HTTP_JWT_CHECK_RET_OK)
+        {
+            send_error(ta, HTTP_PERMISSION_DENIED, "cookie is not valid");
+            rc = false;
+        }
+        else
+        {
+            rc = handle_stats(ta);
+        }
+    }
     else if (STARTS_WITH(req_path, "/private"))
     {
-        char user[256];
-        int valid;
-        valid = http_check_jwt_req_valid(ta, user);
+        int valid = ta->req_method == HTTP_GET ? token : http_check_jwt_req_valid(ta, user);
         if (valid == HTTP_JWT_CHECK_RET_USER_NG)
         {
             send_not_found(ta);
@@ -722,14 +1391,19 @@ bool http_handle_transaction(struct http_transaction *ta, struct http_client *se
         }
         else
         {
-            rc = handle_static_asset(ta, server_root);
+            rc = handle_static_asset(ta, file);
         }
     }
     else
     {
-        rc = handle_static_asset(ta, server_root);
+        rc = handle_static_asset(ta, file);
+    }
+    if (file != NULL)
+    {
+        filecache_put(file);
     }
 
+    admission_txn_end();
     buffer_delete(&ta->resp_headers);
     buffer_delete(&ta->resp_body);
 
@@ -737,20 +1411,27 @@ bool http_handle_transaction(struct http_transaction *ta, struct http_client *se
 }
 
 /**
- * Free the dynamically allocated memory in ta
+ * Prepare a transaction for the next request on a connection.
+ * Header slots beyond req_headercnt are never read, and the arena
+ * carries over from the previous request, so only the fields before
+ * them are cleared.
  * @param ta The structure stores all the transaction information
+ * @param jwt The token manager used to check the request's credentials
  */
-void http_transaction_clean(struct http_transaction *ta)
+void http_transaction_init(struct http_transaction *ta, jwtmgr *jwt)
 {
+    memset(ta, 0, offsetof(struct http_transaction, arena));
+    ta->jwt = jwt;
+}
 
-    for (int i = 0; i < MAX_HEADER_NUM; i++)
-    {
-        if (ta->req_headernames[i] != NULL)
-        {
-            free(ta->req_headernames[i]);
-            ta->req_headernames[i] = NULL;
-            free(ta->req_headervalues[i]);
-            ta->req_headervalues[i] = NULL;
-        }
-    }
-}
\ No newline at end of file
+/**
+ * Release what a transaction holds once it is done.  Headers are views
+ * into the client's bufio, so there is nothing to free for them, and
+ * the arena is rewound rather than freed, ready for the next request.
+ * @param ta The structure stores all the transaction information
+ */
+void http_transaction_clean(struct http_transaction *ta)
+{
+    ta->req_headercnt = 0;
+    arena_reset(&ta->arena);
+}
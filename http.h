@@ -2,9 +2,17 @@
 #define _HTTP_H
 
 #include <jwt.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "arena.h"
 #include "buffer.h"
 #include "jwtmgr.h"
+#include "timerwheel.h"
+#include "http_headers.h"
+#include "http_parser.h"
+#include "mimetypes.h"
 
 struct bufio;
 
@@ -23,25 +31,20 @@ enum http_version {
 
 enum http_response_status {
     HTTP_OK = 200,
+    HTTP_PARTIAL_CONTENT = 206,
+    HTTP_NOT_MODIFIED = 304,
     HTTP_BAD_REQUEST = 400,
     HTTP_PERMISSION_DENIED = 403,
     HTTP_NOT_FOUND = 404,
     HTTP_METHOD_NOT_ALLOWED = 405,
     HTTP_REQUEST_TIMEOUT = 408,
     HTTP_REQUEST_TOO_LONG = 414,
+    HTTP_RANGE_NOT_SATISFIABLE = 416,
     HTTP_INTERNAL_ERROR = 500,
     HTTP_NOT_IMPLEMENTED = 501,
     HTTP_SERVICE_UNAVAILABLE = 503
 };
 
-enum http_header_name {
-    HTTP_HEADER_CONNECTION,
-    HTTP_HEADER_COOKIE,
-    HTTP_HEADER_ACCEPT,
-    HTTP_HEADER_CONTENT_TYPE,
-    HTTP_HEADER_CONTENT_ENCODING
-};
-
 enum http_jwt_check_ret {
     HTTP_JWT_CHECK_RET_OK = 0,
     HTTP_JWT_CHECK_RET_USER_NG = -1,
@@ -50,6 +53,19 @@ enum http_jwt_check_ret {
     HTTP_JWT_CHECK_RET_COOKIE_NOT_EXIST = -4,
 };
 
+/*
+ * A request header, as offsets into the client's bufio.  Name and value
+ * are NUL-terminated in place, so they can be used as C strings once
+ * converted with bufio_offset2ptr.
+ */
+struct http_header {
+    uint32_t name;
+    uint32_t value;
+    uint32_t name_len;
+    uint32_t value_len;
+    enum http_header_name id;
+};
+
 struct http_transaction {
     /* request related fields */
     enum http_method req_method;
@@ -65,21 +81,48 @@ struct http_transaction {
 
     struct http_client *client;
 
-
-    char *req_headernames[MAX_HEADER_NUM];   //The array store header names
-    char *req_headervalues[MAX_HEADER_NUM];  //The array store the value in the header
-    int req_headercnt;
     jwtmgr *jwt; //object handle the java wen token
     int IsKeepAlive;  //if HTTP 1.1 version, do we need to keep connection
+    int req_headercnt;
+
+    /* must stay last: http_transaction_init does not clear these */
+    struct arena arena;     // temporary allocations, released when the transaction is cleaned
+    struct http_header req_headers[MAX_HEADER_NUM];
+};
+
+/* What a connection is waiting for; each phase has its own deadline. */
+enum http_client_phase {
+    HTTP_PHASE_BUSY,        // processing a request, no deadline
+    HTTP_PHASE_IDLE,        // keep-alive connection waiting for the next request
+    HTTP_PHASE_HEADER,      // reading the request line and headers
+    HTTP_PHASE_BODY,        // reading the request body
+    HTTP_PHASE_WRITE        // waiting for the client to accept queued response data
 };
 
 struct http_client {
     struct bufio *bufio;
+    struct http_parser parser;          // parses the request being received
+
+    struct timer deadline;              // fires when the current phase takes too long
+    enum http_client_phase phase;
+    enum http_client_phase expired_phase;
+    atomic_bool timed_out;
+    struct timerwheel *wheel;           // NULL if deadlines are not enforced
+    pthread_mutex_t *wheel_lock;        // NULL if the wheel is only used by this thread
 };
 
 void http_setup_client(struct http_client *, struct bufio *bufio);
+void http_client_set_timeouts(struct http_client *self, struct timerwheel *wheel, pthread_mutex_t *lock);
+void http_client_set_phase(struct http_client *self, enum http_client_phase phase);
+bool http_send_request_timeout(struct http_client *self);
+bool http_send_request_too_large(struct http_client *self, bool head_complete);
+int http_request_ready(struct http_client *self, bool *head_complete);
 bool http_handle_transaction(struct http_transaction *ta, struct http_client *self);
 void http_add_header(buffer_t * resp, char* key, char* fmt, ...);
+void http_transaction_init(struct http_transaction *ta, jwtmgr *jwt);
 void http_transaction_clean(struct http_transaction *ta);
+char *http_get_header(struct http_transaction *ta, const char *name);
+size_t http_render_file_head(char *buf, size_t size, const struct mime_type *mime, const char *last_modified,
+                             bool vary, off_t length, const char *etag, const char *encoding);
 
 #endif /* _HTTP_H */
@@ -0,0 +1,39 @@
+/*
+ * Recognition of request header names.
+ *
+ * A name is hashed once and looked up in a collision-free table that is
+ * generated at build time (see mkheadertable.c), so recognising a header
+ * costs one hash and at most one comparison, however many names are
+ * known.
+ */
+#include <strings.h>
+
+#include "http_headers.h"
+#include "http_header_table.h"
+
+#define HTTP_HEADER_NAME(id, name) [id] = name,
+static const char *names[HTTP_HEADER_COUNT] = { HTTP_HEADER_LIST(HTTP_HEADER_NAME) };
+
+#define HTTP_HEADER_LEN(id, name) [id] = sizeof(name) - 1,
+static const unsigned char lengths[HTTP_HEADER_COUNT] = { HTTP_HEADER_LIST(HTTP_HEADER_LEN) };
+
+/**
+ * Identify a header name.
+ * @param name The name, not necessarily NUL-terminated
+ * @param len The length of the name
+ * @return the header's id, or HTTP_HEADER_OTHER if it is not a known one
+ */
+enum http_header_name http_header_lookup(const char *name, size_t len)
+{
+    uint32_t slot = http_header_hash(name, len, HTTP_HEADER_HASH_SEED) & (HTTP_HEADER_TABLE_SIZE - 1);
+    int id = header_table[slot];
+    if (id == HTTP_HEADER_OTHER || lengths[id] != len || strncasecmp(names[id], name, len))
+        return HTTP_HEADER_OTHER;
+    return id;
+}
+
+/* The canonical spelling of a known header name. */
+const char *http_header_string(enum http_header_name id)
+{
+    return id >= 0 && id < HTTP_HEADER_COUNT ? names[id] : NULL;
+}
@@ -0,0 +1,70 @@
+#ifndef _HTTP_HEADERS_H
+#define _HTTP_HEADERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The request header names the server recognises.  Adding one here is
+ * all that is needed: the perfect hash table used to look them up,
+ * http_header_table.h, is generated from this list by mkheadertable
+ * when the server is built.
+ */
+#define HTTP_HEADER_LIST(X)                                     \
+    X(HTTP_HEADER_ACCEPT,               "Accept")               \
+    X(HTTP_HEADER_ACCEPT_CHARSET,       "Accept-Charset")       \
+    X(HTTP_HEADER_ACCEPT_ENCODING,      "Accept-Encoding")      \
+    X(HTTP_HEADER_ACCEPT_LANGUAGE,      "Accept-Language")      \
+    X(HTTP_HEADER_AUTHORIZATION,        "Authorization")        \
+    X(HTTP_HEADER_CACHE_CONTROL,        "Cache-Control")        \
+    X(HTTP_HEADER_CONNECTION,           "Connection")           \
+    X(HTTP_HEADER_CONTENT_ENCODING,     "Content-Encoding")     \
+    X(HTTP_HEADER_CONTENT_LENGTH,       "Content-Length")       \
+    X(HTTP_HEADER_CONTENT_TYPE,         "Content-Type")         \
+    X(HTTP_HEADER_COOKIE,               "Cookie")               \
+    X(HTTP_HEADER_DATE,                 "Date")                 \
+    X(HTTP_HEADER_EXPECT,               "Expect")               \
+    X(HTTP_HEADER_FORWARDED,            "Forwarded")            \
+    X(HTTP_HEADER_HOST,                 "Host")                 \
+    X(HTTP_HEADER_IF_MATCH,             "If-Match")             \
+    X(HTTP_HEADER_IF_MODIFIED_SINCE,    "If-Modified-Since")    \
+    X(HTTP_HEADER_IF_NONE_MATCH,        "If-None-Match")        \
+    X(HTTP_HEADER_IF_RANGE,             "If-Range")             \
+    X(HTTP_HEADER_IF_UNMODIFIED_SINCE,  "If-Unmodified-Since")  \
+    X(HTTP_HEADER_KEEP_ALIVE,           "Keep-Alive")           \
+    X(HTTP_HEADER_ORIGIN,               "Origin")               \
+    X(HTTP_HEADER_PRAGMA,               "Pragma")               \
+    X(HTTP_HEADER_RANGE,                "Range")                \
+    X(HTTP_HEADER_REFERER,              "Referer")              \
+    X(HTTP_HEADER_TE,                   "TE")                   \
+    X(HTTP_HEADER_TRANSFER_ENCODING,    "Transfer-Encoding")    \
+    X(HTTP_HEADER_UPGRADE,              "Upgrade")              \
+    X(HTTP_HEADER_USER_AGENT,           "User-Agent")           \
+    X(HTTP_HEADER_VIA,                  "Via")                  \
+    X(HTTP_HEADER_X_FORWARDED_FOR,      "X-Forwarded-For")
+
+#define HTTP_HEADER_ENUM(id, name) id,
+
+enum http_header_name {
+    HTTP_HEADER_OTHER = -1,     // kept, but only found by name
+    HTTP_HEADER_LIST(HTTP_HEADER_ENUM)
+    HTTP_HEADER_COUNT
+};
+
+/*
+ * Case-insensitive hash of a header name.  OR-ing in 0x20 folds letters
+ * to lower case; it also maps some other bytes onto each other, which
+ * is harmless because a hit is confirmed with one comparison.
+ */
+static inline uint32_t http_header_hash(const char *name, size_t len, uint32_t seed)
+{
+    uint32_t h = len;
+    for (size_t i = 0; i < len; i++)
+        h = h * seed + ((unsigned char) name[i] | 0x20);
+    return h ^ (h >> 15);
+}
+
+enum http_header_name http_header_lookup(const char *name, size_t len);
+const char *http_header_string(enum http_header_name id);
+
+#endif /* _HTTP_HEADERS_H */
@@ -0,0 +1,276 @@
+/*
+ * An incremental HTTP/1.x request head parser.
+ *
+ * The parser is a table-driven state machine.  Each byte is mapped to a
+ * character class, and the transition table yields the next state for
+ * the current state and class.  Work other than the table lookup is
+ * only done when the state changes, i.e., at token boundaries, where
+ * the spans of the method, path, version and header names and values
+ * are recorded.
+ *
+ * The parser does not copy or modify the data.  All of its results are
+ * offsets relative to the first byte of the request, so they stay valid
+ * when the buffer holding the request is reallocated.  It keeps its
+ * position, so when it runs out of data it can be called again with
+ * more of the same request and continues where it stopped, without
+ * rescanning anything.
+ *
+ * Runs of path, header name and header value bytes, which make up most
+ * of a request, are skipped with the vectorized kernels from scan.c
+ * rather than going through the table byte by byte.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "http_parser.h"
+#include "scan.h"
+
+/* Largest request head accepted. */
+#define MAX_HEAD_LEN 65536
+
+/* Character classes. */
+enum {
+    C_CTL,      // control characters other than HT, CR, LF
+    C_TOKEN,    // tchar, see RFC 7230 3.2.6
+    C_VCHAR,    // other visible characters, including obs-text
+    C_COLON,
+    C_SP,
+    C_HT,
+    C_CR,
+    C_LF,
+    NCLASSES
+};
+
+/* States. */
+enum {
+    S_ERROR,
+    S_START,        // before the request line; empty lines are skipped
+    S_METHOD,
+    S_PATH_START,
+    S_PATH,
+    S_VERSION_START,
+    S_VERSION,
+    S_REQ_LF,       // CR seen after the version
+    S_HDR_START,    // at the beginning of a header line
+    S_NAME,
+    S_VALUE_START,  // skipping whitespace before the value
+    S_VALUE,
+    S_HDR_LF,       // CR seen after a header value
+    S_END_LF,       // CR seen on the empty line
+    S_DONE,
+    NSTATES
+};
+
+static unsigned char char_class[256];
+static pthread_once_t char_class_once = PTHREAD_ONCE_INIT;
+
+static const unsigned char transitions[NSTATES][NCLASSES] = {
+    //                 CTL      TOKEN            VCHAR            COLON            SP               HT               CR          LF
+    [S_ERROR]       = { S_ERROR, S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,    S_ERROR },
+    [S_START]       = { S_ERROR, S_METHOD,        S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,         S_START,    S_START },
+    [S_METHOD]      = { S_ERROR, S_METHOD,        S_ERROR,         S_ERROR,         S_PATH_START,    S_ERROR,         S_ERROR,    S_ERROR },
+    [S_PATH_START]  = { S_ERROR, S_PATH,          S_PATH,          S_PATH,          S_ERROR,         S_ERROR,         S_ERROR,    S_ERROR },
+    [S_PATH]        = { S_ERROR, S_PATH,          S_PATH,          S_PATH,          S_VERSION_START, S_ERROR,         S_ERROR,    S_ERROR },
+    [S_VERSION_START] = { S_ERROR, S_VERSION,     S_VERSION,       S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,    S_ERROR },
+    [S_VERSION]     = { S_ERROR, S_VERSION,       S_VERSION,       S_ERROR,         S_ERROR,         S_ERROR,         S_REQ_LF,   S_HDR_START },
+    [S_REQ_LF]      = { S_ERROR, S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,    S_HDR_START },
+    [S_HDR_START]   = { S_ERROR, S_NAME,          S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,         S_END_LF,   S_DONE },
+    [S_NAME]        = { S_ERROR, S_NAME,          S_ERROR,         S_VALUE_START,   S_ERROR,         S_ERROR,         S_ERROR,    S_ERROR },
+    [S_VALUE_START] = { S_ERROR, S_VALUE,         S_VALUE,         S_VALUE,         S_VALUE_START,   S_VALUE_START,   S_HDR_LF,   S_HDR_START },
+    [S_VALUE]       = { S_ERROR, S_VALUE,         S_VALUE,         S_VALUE,         S_VALUE,         S_VALUE,         S_HDR_LF,   S_HDR_START },
+    [S_HDR_LF]      = { S_ERROR, S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,    S_HDR_START },
+    [S_END_LF]      = { S_ERROR, S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,         S_ERROR,    S_DONE },
+    [S_DONE]        = { S_DONE,  S_DONE,          S_DONE,          S_DONE,          S_DONE,          S_DONE,          S_DONE,     S_DONE },
+};
+
+/* Fill in the character class table and pick the scanning kernels.
+ * Run once, on first use, through char_class_once. */
+static void init_char_class(void)
+{
+    scan_init();
+    static const char tchar_specials[] = "!#$%&'*+-.^_`|~";
+
+    for (int c = 0; c < 256; c++)
+    {
+        if (c < 0x20 || c == 0x7f)
+            char_class[c] = C_CTL;
+        else if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+                 || (c != 0 && strchr(tchar_specials, c) != NULL))
+            char_class[c] = C_TOKEN;
+        else
+            char_class[c] = C_VCHAR;
+    }
+    char_class[':'] = C_COLON;
+    char_class[' '] = C_SP;
+    char_class['\t'] = C_HT;
+    char_class['\r'] = C_CR;
+    char_class['\n'] = C_LF;
+}
+
+/* Prepare a parser for a new request. */
+void http_parser_init(struct http_parser *p)
+{
+    pthread_once(&char_class_once, init_char_class);
+
+    p->state = S_START;
+    p->pos = 0;
+    p->mark = 0;
+    p->value_end = 0;
+    p->nheaders = 0;
+    p->content_length = -1;
+    p->head_len = 0;
+}
+
+static struct http_span span(size_t from, size_t to)
+{
+    return (struct http_span) { .off = from, .len = to - from };
+}
+
+/* Parse the value of a Content-Length header; returns -1 if invalid. */
+static long parse_content_length(const char *data, struct http_span value)
+{
+    long n = 0;
+    if (value.len == 0)
+        return -1;
+    for (uint32_t i = 0; i < value.len; i++)
+    {
+        char c = data[value.off + i];
+        if (c < '0' || c > '9' || n > (LONG_MAX - 9) / 10)
+            return -1;
+        n = n * 10 + (c - '0');
+    }
+    return n;
+}
+
+/*
+ * Handle a state change caused by the byte at 'pos'.
+ * Returns false if the request is invalid.
+ */
+static bool transition(struct http_parser *p, const char *data, int from, int to, size_t pos)
+{
+    switch (to)
+    {
+        case S_METHOD:
+        case S_PATH:
+        case S_VERSION:
+        case S_NAME:
+            p->mark = pos;
+            break;
+        case S_VALUE:
+            if (from == S_VALUE_START)
+                p->mark = pos;
+            break;
+        default:
+            break;
+    }
+
+    switch (from)
+    {
+        case S_METHOD:
+            p->method = span(p->mark, pos);
+            break;
+        case S_PATH:
+            p->path = span(p->mark, pos);
+            break;
+        case S_VERSION:
+            p->version = span(p->mark, pos);
+            break;
+        case S_NAME:
+            if (p->nheaders == HTTP_PARSER_MAX_HEADERS)
+                return false;
+            p->headers[p->nheaders].name = span(p->mark, pos);
+            p->headers[p->nheaders].id = http_header_lookup(data + p->mark, pos - p->mark);
+            p->value_end = 0;
+            break;
+        case S_VALUE_START:
+        case S_VALUE:
+            if (to == S_HDR_LF || to == S_HDR_START)
+            {
+                struct http_parser_header *h = &p->headers[p->nheaders++];
+                h->value = from == S_VALUE ? span(p->mark, p->value_end) : span(pos, pos);
+                if (h->id == HTTP_HEADER_CONTENT_LENGTH)
+                {
+                    p->content_length = parse_content_length(data, h->value);
+                    if (p->content_length < 0)
+                        return false;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+/**
+ * Continue parsing a request head.
+ * @param p The parser
+ * @param data The request, starting at its first byte
+ * @param len The number of bytes of the request available so far
+ * @return return HTTP_PARSER_DONE once the head is complete,
+ *         HTTP_PARSER_AGAIN if more data is needed, and
+ *         HTTP_PARSER_ERROR if the data is not a valid request head
+ */
+enum http_parser_result http_parser_execute(struct http_parser *p, const char *data, size_t len)
+{
+    int state = p->state;
+    size_t pos = p->pos;
+
+    for (; pos < len && state != S_DONE; pos++)
+    {
+        size_t run;
+        switch (state)
+        {
+            case S_PATH:
+                pos += scan_path(data + pos, len - pos);
+                break;
+            case S_NAME:
+                pos += scan_name(data + pos, len - pos);
+                break;
+            case S_VALUE:
+                run = scan_value(data + pos, len - pos);
+                for (size_t end = pos + run; end > pos; end--)
+                {
+                    if (data[end - 1] != ' ' && data[end - 1] != '\t')
+                    {
+                        p->value_end = end;
+                        break;
+                    }
+                }
+                pos += run;
+                break;
+            default:
+                break;
+        }
+        if (pos == len)
+            break;
+
+        unsigned char c = data[pos];
+        int next = transitions[state][char_class[c]];
+        if (next == state)
+        {
+            if (state == S_VALUE && c != ' ' && c != '\t')
+                p->value_end = pos + 1;
+            continue;
+        }
+        if (next == S_ERROR || !transition(p, data, state, next, pos))
+        {
+            p->state = S_ERROR;
+            return HTTP_PARSER_ERROR;
+        }
+        if (next == S_VALUE)
+            p->value_end = pos + 1;
+        state = next;
+    }
+
+    p->state = state;
+    p->pos = pos;
+    if (state == S_DONE)
+    {
+        p->head_len = pos;
+        return HTTP_PARSER_DONE;
+    }
+    return pos > MAX_HEAD_LEN ? HTTP_PARSER_ERROR : HTTP_PARSER_AGAIN;
+}
@@ -0,0 +1,47 @@
+#ifndef _HTTP_PARSER_H
+#define _HTTP_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http_headers.h"
+
+#define HTTP_PARSER_MAX_HEADERS 100
+
+enum http_parser_result {
+    HTTP_PARSER_ERROR = -1,     // the data is not a valid request head
+    HTTP_PARSER_AGAIN = 0,      // more data is needed
+    HTTP_PARSER_DONE = 1        // the request head is complete
+};
+
+/* A span of the request, as offset and length relative to its first byte. */
+struct http_span {
+    uint32_t off;
+    uint32_t len;
+};
+
+struct http_parser_header {
+    struct http_span name;
+    struct http_span value;     // without leading and trailing whitespace
+    enum http_header_name id;   // HTTP_HEADER_OTHER if the name is not a known one
+};
+
+struct http_parser {
+    int state;
+    size_t pos;                 // relative offset of the next byte to scan
+    size_t mark;                // start of the token being scanned
+    size_t value_end;           // end of the header value seen so far, without trailing whitespace
+
+    struct http_span method;
+    struct http_span path;
+    struct http_span version;
+    struct http_parser_header headers[HTTP_PARSER_MAX_HEADERS];
+    int nheaders;
+    long content_length;        // -1 if there was no Content-Length header
+    size_t head_len;            // length of request line and headers including the empty line
+};
+
+void http_parser_init(struct http_parser *p);
+enum http_parser_result http_parser_execute(struct http_parser *p, const char *data, size_t len);
+
+#endif /* _HTTP_PARSER_H */
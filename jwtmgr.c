@@ -5,16 +5,18 @@
 #include <string.h>
 #include <jwt.h>
 #include "jwtmgr.h"
+#include "arena.h"
 
 /**
  * Generate new jwt
  * @param mgr The jwt manager
+ * @param arena The arena the returned item is allocated from
  * @param sub The user name
  * @param iat The time generate the token
  * @param exp The expiration time
  * @return return the jwt_item generated
  */
-jwt_item* gen_new_jwt_token(jwtmgr *mgr, char* sub, time_t iat, time_t exp)
+jwt_item* gen_new_jwt_token(jwtmgr *mgr, struct arena *arena, char* sub, time_t iat, time_t exp)
 {
     jwt_t *jwt;
     jwt_new(&jwt);
@@ -23,10 +25,15 @@ jwt_item* gen_new_jwt_token(jwtmgr *mgr, char* sub, time_t iat, time_t exp)
     jwt_add_grant_int(jwt, "exp", exp);
     jwt_set_alg(jwt, JWT_ALG_HS256, (unsigned char *)mgr->key, strlen(mgr->key));
 
-    jwt_item* it = (jwt_item *)calloc(1, sizeof(jwt_item));
+    jwt_item* it = (jwt_item *)arena_alloc(arena, sizeof(jwt_item));
     strcpy(it->subname,sub);
-    strcpy(it->token,jwt_encode_str(jwt));
-    strcpy(it->grants, jwt_get_grants_json(jwt, NULL));
+    // the strings libjwt returns are malloc'd and owned by the caller
+    char *token = jwt_encode_str(jwt);
+    strcpy(it->token, token);
+    free(token);
+    char *grants = jwt_get_grants_json(jwt, NULL);
+    strcpy(it->grants, grants);
+    free(grants);
     jwt_free(jwt);
     return it;
 }
@@ -80,13 +87,14 @@ jwt_item* get_jwt_token(jwtmgr *mgr, char *sub)
  */
 int decode_jwt_token(jwtmgr *mgr, char *token, jwt_item* jwtitem)
 {
-    jwt_t *jwt;
-    jwt_new(&jwt);
+    jwt_t *jwt = NULL;      // allocated by jwt_decode
 
     int ret = jwt_decode(&jwt, token, (unsigned char *)mgr->key, strlen(mgr->key));
     if (ret == 0)
     {
-        strcpy(jwtitem->grants, jwt_get_grants_json(jwt, NULL));
+        char *grants = jwt_get_grants_json(jwt, NULL);
+        strcpy(jwtitem->grants, grants);
+        free(grants);
         strcpy(jwtitem->token, token);
         strcpy(jwtitem->subname, jwt_get_grant(jwt, "sub"));
     }
@@ -2,6 +2,8 @@
 
 #define MAX_JWT_ITEM_NUM 1000
 
+struct arena;
+
 typedef struct _jwt_item
 {
     char subname[100];
@@ -16,7 +18,7 @@ typedef struct _jwtmgr
     jwt_item jwtpool[MAX_JWT_ITEM_NUM];
 }jwtmgr;
 
-extern jwt_item* gen_new_jwt_token(jwtmgr *mgr, char* sub, time_t iat, time_t exp);
+extern jwt_item* gen_new_jwt_token(jwtmgr *mgr, struct arena *arena, char* sub, time_t iat, time_t exp);
 extern int save_jwt_token(jwtmgr *mgr, jwt_item* jwtitem);
 extern jwt_item* get_jwt_token(jwtmgr *mgr, char *sub);
 extern jwtmgr* jwtmgr_create_and_init(int id, char* key);
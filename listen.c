@@ -1,38 +1,68 @@
 
+#define _GNU_SOURCE
+
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
 #include "buffer.h"
 #include "hexdump.h"
 #include "http.h"
 #include "socket.h"
 #include "bufio.h"
 #include "globals.h"
+#include "threadpool.h"
+#include "admission.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
 
 extern jwtmgr *jwtlib;
+struct threadpool *worker_pool;     // NULL means one thread per connection
+
+/* Responses to pipelined requests are sent together, up to this many bytes. */
+#define PIPELINE_FLUSH_LIMIT (256 * 1024)
+
+/* Deadlines of all connections served by blocking threads. */
+static struct timerwheel conn_wheel;
+static pthread_mutex_t conn_wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool conn_wheel_running;
 
 /**
- * Handle http transaction
- * @param args The socket number
+ * Serve all http transactions on a client connection, then close it
+ * @param sock The client socket
  */
-void*  do_http_handle(void *args)
+void serve_client(int sock)
 {
     int ret;
-    int *sock = (int *)args;
     struct http_client *client = (struct http_client *)malloc(sizeof(struct http_client));
     memset(client, 0, sizeof(struct http_client));
     struct http_transaction *ta = (struct http_transaction *)malloc(sizeof(struct http_transaction));
+    arena_init(&ta->arena);
 
-    http_setup_client(client, bufio_create(*sock));
+    http_setup_client(client, bufio_capacity > 0 ? bufio_create_fixed(sock, bufio_capacity)
+                                                  : bufio_create(sock));
+    if (conn_wheel_running)
+    {
+        http_client_set_timeouts(client, &conn_wheel, &conn_wheel_lock);
+    }
+#ifdef HAVE_IO_URING
+    if (use_io_uring)
+    {
+        bufio_enable_uring(client->bufio);
+    }
+#endif
     while (1)
     {
-        memset(ta, 0, sizeof(struct http_transaction));
-
-        ta->jwt = jwtlib;
+        http_transaction_init(ta, jwtlib);
 
         // handle http request
         ret = http_handle_transaction(ta, client);
@@ -50,15 +80,136 @@ void*  do_http_handle(void *args)
         {
             break;
         }
+
+        // drop the finished request, keeping any pipelined ones
+        bufio_truncate(client->bufio);
+
+        // while the next request is already buffered, hold back responses to
+        // send them together; send them once the next request has to be waited for
+        bool head_complete;
+        if (bufio_queued(client->bufio) <= PIPELINE_FLUSH_LIMIT
+            && http_request_ready(client, &head_complete) == 1)
+        {
+            bufio_cork(client->bufio);
+        }
+        else if (bufio_uncork(client->bufio) == -1)
+        {
+            break;
+        }
     }
+    bufio_uncork(client->bufio);
 
+    // disarm the deadline before its timer's memory goes away
+    http_client_set_phase(client, HTTP_PHASE_BUSY);
     bufio_close(client->bufio);
     free(client);
+    arena_destroy(&ta->arena);
     free(ta);
+    admission_conn_close();
+}
+
+/**
+ * Handle http transaction in a thread of its own
+ * @param args Pointer to the socket number, freed here
+ */
+void*  do_http_handle(void *args)
+{
+    int *sock = (int *)args;
+    serve_client(*sock);
     free(sock);
     return NULL;
 }
 
+/**
+ * Hand an accepted client to a worker, or to a thread of its own
+ * @param client_socket The client socket
+ */
+static void dispatch_client(int client_socket)
+{
+    pthread_t th;
+
+    if (!admission_conn_open(client_socket))
+    {
+        return;
+    }
+
+    if (worker_pool != NULL)
+    {
+        threadpool_submit(worker_pool, client_socket);
+        return;
+    }
+
+    // create new thread to handle http transaction
+    int *pdatasock = (int *)malloc(sizeof(int));
+    *pdatasock = client_socket;
+    if (pthread_create(&th, NULL, do_http_handle, pdatasock) != 0)
+    {
+        close(client_socket);
+        free(pdatasock);
+        admission_conn_close();
+        return;
+    }
+    pthread_detach(th);
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * Accept clients with a single multishot accept request, which keeps
+ * posting a completion per accepted client until it is cancelled.
+ * @param sock The listening socket
+ */
+static void uring_listen_and_accept(int sock)
+{
+    struct uring ring;
+    bool armed = false;
+
+    if (uring_init(&ring, 64) == -1)
+    {
+        perror("io_uring");
+        return;
+    }
+
+    while (1)
+    {
+        if (!armed)
+        {
+            struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = sock;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            armed = true;
+        }
+        if (uring_submit_and_wait(&ring, 1) == -1)
+        {
+            perror("io_uring_enter");
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&ring)) != NULL)
+        {
+            int client_socket = cqe->res;
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+            {
+                armed = false;
+            }
+            uring_cqe_seen(&ring);
+
+            if (client_socket < 0)
+            {
+                fprintf(stderr, "socket accept failed\n");
+                continue;
+            }
+            // see socket_accept_client
+            int i = 1;
+            setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (void *)&i, sizeof(i));
+            dispatch_client(client_socket);
+        }
+    }
+    uring_exit(&ring);
+}
+#endif
+
 /**
  * A thread to listen request and accept request
  * @param args The socket number
@@ -66,14 +217,19 @@ void*  do_http_handle(void *args)
  */
 void* do_listen_and_accept(void* args)
 {
-    pthread_t th;
-    int sock = accepting_socket;
+    int sock = (int)(intptr_t)args;
+
+#ifdef HAVE_IO_URING
+    if (use_io_uring)
+    {
+        uring_listen_and_accept(sock);
+        return NULL;
+    }
+#endif
 
     while(1)
     {
-        int *pdatasock = (int *)malloc(sizeof(int));
         int client_socket = socket_accept_client(sock);
-        *pdatasock = client_socket;
 
         if (client_socket == -1)
         {
@@ -81,22 +237,91 @@ void* do_listen_and_accept(void* args)
             break;
         }
 
-        // create new thread to handle http transaction
-        pthread_create(&th, NULL, do_http_handle, pdatasock);
+        dispatch_client(client_socket);
     }
 
     return NULL;
 }
 
-int create_listen_thread(pthread_t *thhander, int listensocket)
+/**
+ * A thread advancing the deadline timing wheel once per tick
+ * @param args Unused
+ */
+static void* do_timeout_tick(void *args)
+{
+    struct timespec tick = { 0, TIMERWHEEL_TICK_MS * 1000000L };
+
+    while (1)
+    {
+        nanosleep(&tick, NULL);
+        pthread_mutex_lock(&conn_wheel_lock);
+        timerwheel_advance(&conn_wheel, timerwheel_clock());
+        pthread_mutex_unlock(&conn_wheel_lock);
+    }
+    return NULL;
+}
+
+/**
+ * Start enforcing idle, header and body deadlines on connections
+ * served by blocking threads.  Must be called before clients are accepted.
+ * @return return 0 on success
+ */
+int start_timeout_thread(void)
+{
+    pthread_t th;
+
+    timerwheel_init(&conn_wheel, timerwheel_clock());
+    if (pthread_create(&th, NULL, do_timeout_tick, NULL) != 0)
+    {
+        printf("Create thread error!\n");
+        return -1;
+    }
+    pthread_detach(th);
+    conn_wheel_running = true;
+    return 0;
+}
+
+/**
+ * Pin a thread to a CPU
+ * @param th The thread
+ * @param cpu The CPU number; wraps around the number of online CPUs
+ * @return return 0 on success
+ */
+int pin_thread_to_cpu(pthread_t th, int cpu)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % (ncpus > 0 ? ncpus : 1), &set);
+    int ret = pthread_setaffinity_np(th, sizeof(set), &set);
+    if (ret != 0)
+    {
+        fprintf(stderr, "pin thread to cpu %d failed\n", cpu);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Create a thread accepting clients on a listening socket
+ * @param thhander Receives the thread handle
+ * @param listensocket The listening socket
+ * @param cpu The CPU to pin the thread to, or -1 to not pin it
+ * @return return 0 on success
+ */
+int create_listen_thread(pthread_t *thhander, int listensocket, int cpu)
 {
     int ret;
-    ret = pthread_create(thhander, NULL, do_listen_and_accept, &listensocket);
+    ret = pthread_create(thhander, NULL, do_listen_and_accept, (void *)(intptr_t)listensocket);
 
     if (ret != 0)
     {
         printf("Create thread error!\n");
         return -1;
     }
+    if (cpu >= 0)
+    {
+        pin_thread_to_cpu(*thhander, cpu);
+    }
     return 0;
 }
\ No newline at end of file
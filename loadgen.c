@@ -0,0 +1,287 @@
+/*
+ * Keep-alive load generator used to benchmark the server.
+ *
+ * Opens a number of concurrent keep-alive connections and has each of
+ * them issue GET requests back-to-back for a fixed duration, using a
+ * single epoll loop.  With -k, each connection pipelines that many
+ * requests, sending a new one for every response received.  Reports throughput and latency percentiles and,
+ * if the server's pid is given, the server's resident set size and
+ * thread count as read from /proc.
+ *
+ * Example: compare thread-per-connection with 4 event loops
+ *
+ *   ./server -p 10000 -R root -s &          ./loadgen -p 10000 -c 10000 -P $!
+ *   ./server -p 10000 -R root -s -E 4 &     ./loadgen -p 10000 -c 10000 -P $!
+ *
+ * Example: pipelined load, 16 requests in flight per connection
+ *
+ *   ./loadgen -p 10000 -c 50 -k 16
+ */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DEPTH 64
+
+struct conn
+{
+    int fd;
+    char resp[16384];
+    size_t resplen;
+    size_t body_left;           // bytes of the current response's body not yet received
+    double sent_at[MAX_DEPTH];  // times the outstanding requests were sent, oldest at 'first'
+    int first;
+};
+
+static char request[1024];
+static size_t request_len;
+static char pipeline[MAX_DEPTH * sizeof(request)];     // 'depth' copies of the request
+static int depth = 1;
+static double *latencies;
+static size_t nlatencies, maxlatencies;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(char *av0)
+{
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c conns] [-d seconds] [-u path] [-k depth] [-P serverpid]\n"
+                    "  -H host      server to connect to (default localhost)\n"
+                    "  -p port      server port (default 10000)\n"
+                    "  -c conns     number of concurrent keep-alive connections (default 100)\n"
+                    "  -d seconds   duration of the measurement (default 10)\n"
+                    "  -u path      path to request (default /index.html)\n"
+                    "  -k depth     pipelined requests in flight per connection (default 1, max %d)\n"
+                    "  -P pid       report RSS and threads of this server process\n"
+            , av0, MAX_DEPTH);
+    exit(EXIT_FAILURE);
+}
+
+static int connect_to(struct addrinfo *ai)
+{
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1)
+        return -1;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    int i = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/* Send n requests with one write. */
+static bool send_requests(struct conn *c, int n)
+{
+    double t = now();
+    for (int i = 0; i < n; i++)
+        c->sent_at[(c->first + depth - n + i) % MAX_DEPTH] = t;
+    return send(c->fd, pipeline, n * request_len, MSG_NOSIGNAL) == n * request_len;
+}
+
+static void record(double latency)
+{
+    if (nlatencies == maxlatencies)
+    {
+        maxlatencies = maxlatencies ? maxlatencies * 2 : 1 << 16;
+        latencies = realloc(latencies, maxlatencies * sizeof(*latencies));
+    }
+    latencies[nlatencies++] = latency;
+}
+
+/* Consume the responses, and parts of them, in c->resp.  A body is
+ * counted off as it arrives rather than buffered, so it may be of any
+ * size.  Return the number of responses completed. */
+static int consume_responses(struct conn *c)
+{
+    int done = 0;
+    size_t pos = 0;
+    for (;;)
+    {
+        if (c->body_left > 0)
+        {
+            size_t n = c->resplen - pos < c->body_left ? c->resplen - pos : c->body_left;
+            pos += n;
+            c->body_left -= n;
+            if (c->body_left > 0)
+                break;
+        }
+        else
+        {
+            char *head = c->resp + pos;
+            char *end = memmem(head, c->resplen - pos, "\r\n\r\n", 4);
+            if (end == NULL)
+                break;
+            *end = '\0';       // only search the head, not the body or responses after it
+            char *cl = strcasestr(head, "Content-Length:");
+            *end = '\r';
+            c->body_left = cl != NULL ? strtoul(cl + 15, NULL, 10) : 0;
+            pos = end - c->resp + 4;
+            if (c->body_left > 0)
+                continue;
+        }
+        record(now() - c->sent_at[c->first]);
+        c->first = (c->first + 1) % MAX_DEPTH;
+        done++;
+    }
+    c->resplen -= pos;
+    memmove(c->resp, c->resp + pos, c->resplen);
+    return done;
+}
+
+static int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double p)
+{
+    if (nlatencies == 0)
+        return 0;
+    size_t i = (size_t)(p / 100.0 * (nlatencies - 1));
+    return latencies[i] * 1e3;
+}
+
+static void report_server(int pid)
+{
+    char path[64], line[256];
+    snprintf(path, sizeof path, "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        perror(path);
+        return;
+    }
+    while (fgets(line, sizeof line, f))
+    {
+        if (!strncmp(line, "VmRSS:", 6) || !strncmp(line, "VmHWM:", 6) || !strncmp(line, "Threads:", 8))
+            printf("server %s", line);
+    }
+    fclose(f);
+}
+
+int main(int ac, char *av[])
+{
+    char *host = "localhost", *port = "10000", *path = "/index.html";
+    int nconns = 100, duration = 10, serverpid = 0, opt;
+
+    while ((opt = getopt(ac, av, "H:p:c:d:u:k:P:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'H': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'c': nconns = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'u': path = optarg; break;
+            case 'k': depth = atoi(optarg); break;
+            case 'P': serverpid = atoi(optarg); break;
+            default: usage(av[0]);
+        }
+    }
+    if (depth < 1 || depth > MAX_DEPTH)
+        usage(av[0]);
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct addrinfo hint = { .ai_socktype = SOCK_STREAM }, *ai;
+    int rc = getaddrinfo(host, port, &hint, &ai);
+    if (rc != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        exit(EXIT_FAILURE);
+    }
+
+    request_len = snprintf(request, sizeof request,
+                           "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: loadgen\r\n"
+                           "Accept: */*\r\nConnection: keep-alive\r\n\r\n", path, host);
+    for (int i = 0; i < depth; i++)
+        memcpy(pipeline + i * request_len, request, request_len);
+
+    int epfd = epoll_create1(0);
+    struct conn *conns = calloc(nconns, sizeof(*conns));
+    int open_conns = 0;
+    for (int i = 0; i < nconns; i++)
+    {
+        conns[i].fd = connect_to(ai);
+        if (conns[i].fd == -1)
+        {
+            perror("connect");
+            break;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &conns[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+        open_conns++;
+    }
+    printf("%d connections open\n", open_conns);
+    if (serverpid)
+        report_server(serverpid);
+
+    for (int i = 0; i < open_conns; i++)
+        send_requests(&conns[i], depth);
+
+    size_t errors = 0;
+    double start = now(), end = start + duration;
+    struct epoll_event events[256];
+    while (now() < end)
+    {
+        int n = epoll_wait(epfd, events, 256, 100);
+        for (int i = 0; i < n; i++)
+        {
+            struct conn *c = events[i].data.ptr;
+            ssize_t r = recv(c->fd, c->resp + c->resplen, sizeof(c->resp) - c->resplen, 0);
+            if (r <= 0)
+            {
+                if (r == -1 && errno == EAGAIN)
+                    continue;
+                errors++;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                close(c->fd);
+                continue;
+            }
+            c->resplen += r;
+            int done = consume_responses(c);
+            if (done > 0 && !send_requests(c, done))
+                errors++;
+        }
+    }
+    double elapsed = now() - start;
+
+    if (serverpid)
+        report_server(serverpid);
+    qsort(latencies, nlatencies, sizeof(*latencies), cmpdouble);
+    printf("%zu requests in %.2fs, %.0f req/s, %zu errors\n",
+           nlatencies, elapsed, nlatencies / elapsed, errors);
+    printf("latency ms: p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+           percentile(50), percentile(90), percentile(99), percentile(99.9), percentile(100));
+    return 0;
+}
@@ -16,6 +16,13 @@
 #include "socket.h"
 #include "bufio.h"
 #include "globals.h"
+#include "evloop.h"
+#include "threadpool.h"
+#include "admission.h"
+#include "filecache.h"
+#include "compcache.h"
+#include "mimetypes.h"
+#include "watcher.h"
 
 /* Implement HTML5 fallback.
  * This means that if a non-API path refers to a file and that
@@ -25,7 +32,15 @@
 bool html5_fallback = false;
 bool silent_mode = false;
 int token_expiration_time = 24 * 60 * 60;   // default token expiration time is 1 day
+int idle_timeout = 30;      // seconds a keep-alive connection may wait for its next request
+int header_timeout = 10;    // seconds a client may take to send request line and headers
+int body_timeout = 30;      // seconds a client may take to send the request body
 int accepting_socket;
+int evloop_threads = 0;     // 0 means one thread per connection
+int bufio_capacity = 0;     // fixed per-connection input buffer size; 0 means it grows as needed
+#ifdef HAVE_IO_URING
+bool use_io_uring = false;
+#endif
 jwtmgr *jwtlib;
 
 
@@ -33,10 +48,37 @@ jwtmgr *jwtlib;
 static void
 usage(char * av0)
 {
-    fprintf(stderr, "Usage: %s [-p port] [-R rootdir] [-h] [-e seconds]\n"
+    fprintf(stderr, "Usage: %s [-p port] [-R rootdir] [-h] [-e seconds] [-E threads] [-w workers] [-r shards] [-C]\n"
+                    "       [-c maxconns] [-q maxinflight] [-k seconds] [-H seconds] [-b seconds] [-m bytes]\n"
+                    "       [-f maxfiles] [-F maxfds] [-B bytes] [-t seconds] [-Z bytes]\n"
+                    "       [-M mimetypes]\n"
                     "  -p port      port number to bind to\n"
                     "  -R rootdir   root directory from which to serve files\n"
                     "  -e seconds   expiration time for tokens in seconds\n"
+                    "  -E threads   serve clients from this many epoll event loops\n"
+                    "  -w workers   serve clients from a pool of this many worker threads (not with -E)\n"
+                    "  -r shards    accept on this many SO_REUSEPORT listening sockets (with -E, at most\n"
+                    "               one per event loop)\n"
+                    "  -C           pin each accept thread or event loop to its own CPU\n"
+                    "  -c maxconns  answer 503 to clients beyond this many open connections\n"
+                    "  -q maxinflight  answer 503 beyond this many concurrent requests\n"
+                    "  -k seconds   close keep-alive connections idle this long (0: never)\n"
+                    "  -H seconds   answer 408 if headers take longer than this (0: never)\n"
+                    "  -b seconds   answer 408 if the body takes longer than this (0: never)\n"
+                    "  -m bytes     give each connection a fixed input buffer of this size\n"
+                    "  -f maxfiles  keep up to this many static files open and cached (0: none)\n"
+                    "  -F maxfds    let cached files hold at most this many descriptors\n"
+                    "  -B bytes     keep small cached files in memory, as complete responses,\n"
+                    "               up to this many bytes in total (0: none)\n"
+                    "  -t seconds   check a cached file for changes after this long, if\n"
+                    "               changes to the root directory cannot be watched\n"
+                    "  -Z bytes     cache files gzip-compressed on the fly up to this many bytes\n"
+                    "               in total (0: only send precompressed .br/.gz sidecars)\n"
+                    "  -M mimetypes read Content-Types by extension from this mime.types file\n"
+                    "               (default: /etc/mime.types if it exists)\n"
+#ifdef HAVE_IO_URING
+                    "  -U           use io_uring for accept and client I/O (not with -E)\n"
+#endif
                     "  -h           display this help\n"
             , av0);
     exit(EXIT_FAILURE);
@@ -47,10 +89,20 @@ main(int ac, char *av[])
 {
     int opt;
     char *port_string = NULL;
-    pthread_t listenth;
     char dirbuff[1024];
+    int nworkers = 0;
+    int nshards = 0;
+    bool pin_cpus = false;
+    int max_connections = 0;
+    int max_inflight = 0;
+    int cache_files = 1024;
+    int cache_fds = 512;
+    long cache_bytes = 16 * 1024 * 1024;
+    int cache_ttl = 2;
+    long compressed_bytes = 16 * 1024 * 1024;
+    const char *mime_types = NULL;
     server_root = NULL;
-    while ((opt = getopt(ac, av, "ahp:R:se:")) != -1) {
+    while ((opt = getopt(ac, av, "ahp:R:se:E:w:r:CUc:q:k:H:b:m:f:F:B:t:Z:M:")) != -1) {
         switch (opt) {
             case 'a':
                 html5_fallback = true;
@@ -69,6 +121,82 @@ main(int ac, char *av[])
                 silent_mode = true;
                 break;
 
+            case 'E':
+                evloop_threads = atoi(optarg);
+                if (evloop_threads < 1)
+                    usage(av[0]);
+                break;
+
+            case 'w':
+                nworkers = atoi(optarg);
+                if (nworkers < 1)
+                    usage(av[0]);
+                break;
+
+            case 'r':
+                nshards = atoi(optarg);
+                if (nshards < 1)
+                    usage(av[0]);
+                break;
+
+            case 'C':
+                pin_cpus = true;
+                break;
+
+            case 'c':
+                max_connections = atoi(optarg);
+                break;
+
+            case 'q':
+                max_inflight = atoi(optarg);
+                break;
+
+            case 'k':
+                idle_timeout = atoi(optarg);
+                break;
+
+            case 'H':
+                header_timeout = atoi(optarg);
+                break;
+
+            case 'b':
+                body_timeout = atoi(optarg);
+                break;
+
+            case 'm':
+                bufio_capacity = atoi(optarg);
+                break;
+
+            case 'f':
+                cache_files = atoi(optarg);
+                break;
+
+            case 'F':
+                cache_fds = atoi(optarg);
+                break;
+
+            case 'B':
+                cache_bytes = atol(optarg);
+                break;
+
+            case 't':
+                cache_ttl = atoi(optarg);
+                break;
+
+            case 'Z':
+                compressed_bytes = atol(optarg);
+                break;
+
+            case 'M':
+                mime_types = optarg;
+                break;
+
+#ifdef HAVE_IO_URING
+            case 'U':
+                use_io_uring = true;
+                break;
+#endif
+
             case 'R':
                 server_root = optarg;
                 break;
@@ -79,6 +207,27 @@ main(int ac, char *av[])
         }
     }
 
+    // event loops serve their own clients, with neither workers nor io_uring
+    if (evloop_threads > 0 && nworkers > 0)
+    {
+        fprintf(stderr, "-w cannot be used with -E\n");
+        exit(EXIT_FAILURE);
+    }
+#ifdef HAVE_IO_URING
+    if (evloop_threads > 0 && use_io_uring)
+    {
+        fprintf(stderr, "-U cannot be used with -E\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    // each event loop accepts on one listening socket, so more would go unserved
+    if (evloop_threads > 0 && nshards > evloop_threads)
+    {
+        fprintf(stderr, "-r %d needs at least as many event loops, not -E %d\n", nshards, evloop_threads);
+        exit(EXIT_FAILURE);
+    }
+
     if (server_root == NULL)
     {
         fprintf(stderr, "No setting work dir，exit\n");
@@ -91,6 +240,13 @@ main(int ac, char *av[])
         exit(EXIT_FAILURE);
     }
 
+    // read before changing into the server root, which a relative path does not refer to
+    if (mimetypes_load(mime_types != NULL ? mime_types : "/etc/mime.types") == -1 && mime_types != NULL)
+    {
+        fprintf(stderr, "can't read mime types from %s: %s\n", mime_types, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
     // initialize jwt library
     jwtlib = jwtmgr_create_and_init(0, "wusansan");
 
@@ -113,20 +269,71 @@ main(int ac, char *av[])
     }
     server_root = &server_root_real[0];
     fprintf(stderr, "Using port %s\n", port_string);
-    accepting_socket = socket_open_bind_listen(port_string, 1024);
+    int nsockets = nshards > 0 ? nshards : 1;
+    int *listensockets = calloc(nsockets, sizeof(int));
+    if (nshards > 0)
+    {
+        if (socket_open_bind_listen_shards(port_string, 1024, listensockets, nshards) == -1)
+        {
+            fprintf(stderr, "create listen sockets error %s\n", port_string);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        listensockets[0] = socket_open_bind_listen(port_string, 1024);
+    }
+    accepting_socket = listensockets[0];
     if (accepting_socket == -1)
     {
         fprintf(stderr, "create listen socket error %s\n", port_string);
         exit(EXIT_SUCCESS);
     }
 
-    if (create_listen_thread(&listenth, accepting_socket) == 0)
+    admission_init(max_connections, max_inflight);
+    filecache_init(cache_files, cache_fds, cache_bytes, cache_ttl);
+    compcache_init(compressed_bytes);
+    if (html5_fallback)
+        filecache_pin("/index.html");
+    if (cache_files > 0 && watcher_start() < 0)
+        fprintf(stderr, "not watching %s, checking cached files for changes every %d seconds\n",
+                server_root, cache_ttl);
+
+    if (evloop_threads == 0 && (idle_timeout > 0 || header_timeout > 0 || body_timeout > 0))
     {
-        pthread_join(listenth, NULL);
+        if (start_timeout_thread() < 0)
+            exit(EXIT_FAILURE);
+    }
+
+    if (nworkers > 0 && evloop_threads == 0)
+    {
+        worker_pool = threadpool_create(nworkers, serve_client);
+        if (worker_pool == NULL)
+            exit(EXIT_FAILURE);
+    }
+
+    if (evloop_threads > 0)
+    {
+        if (evloop_run(listensockets, nsockets, evloop_threads, pin_cpus) < 0)
+            fprintf(stderr, "listen error %s\n", port_string);
     }
     else
     {
-        fprintf(stderr, "listen error %s\n", port_string);
+        // one accept loop per listening socket
+        pthread_t *listenths = calloc(nsockets, sizeof(pthread_t));
+        int started = 0;
+        for (int i = 0; i < nsockets; i++)
+        {
+            if (create_listen_thread(&listenths[started], listensockets[i], pin_cpus ? i : -1) == 0)
+                started++;
+            else
+                fprintf(stderr, "listen error %s\n", port_string);
+        }
+        for (int i = 0; i < started; i++)
+        {
+            pthread_join(listenths[i], NULL);
+        }
+        free(listenths);
     }
 
     exit(EXIT_SUCCESS);
@@ -0,0 +1,251 @@
+/*
+ * Content-Type lookup by file name extension.
+ *
+ * The table is built once at startup from a mime.types file, in which
+ * each line names a type followed by its extensions, plus a few
+ * built-in types for common web content that such files may lack.
+ * The first definition of an extension wins, so the file overrides
+ * the built-in types.  Extensions are stored folded to lowercase in an
+ * open-addressed hash table with linear probing, and every type comes
+ * with its Content-Type header line rendered in advance.  The table is
+ * never changed after startup, so threads look it up without locking.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mimetypes.h"
+
+#define EXT_MAX 16                  // longest extension kept, with its NUL
+
+struct slot {
+    uint32_t hash;
+    char ext[EXT_MAX];              // folded to lowercase
+    const struct mime_type *type;   // NULL if the slot is empty
+};
+
+static struct slot *table;
+static unsigned mask;               // table size - 1, a power of two minus one
+static unsigned nused;
+
+/* Types for files with no known extension, and built-in defaults. */
+static const struct mime_type octet_stream = {
+    .name = "application/octet-stream",
+    .header = "Content-Type: application/octet-stream\r\n",
+    .header_len = sizeof("Content-Type: application/octet-stream\r\n") - 1,
+};
+
+static const char *const builtin[][2] = {
+    { "text/html", "html htm" },
+    { "text/css", "css" },
+    { "text/javascript", "js mjs" },
+    { "text/plain", "txt" },
+    { "application/json", "json" },
+    { "application/xml", "xml" },
+    { "application/wasm", "wasm" },
+    { "application/pdf", "pdf" },
+    { "image/svg+xml", "svg" },
+    { "image/png", "png" },
+    { "image/jpeg", "jpg jpeg" },
+    { "image/gif", "gif" },
+    { "image/webp", "webp" },
+    { "image/vnd.microsoft.icon", "ico" },
+    { "font/woff", "woff" },
+    { "font/woff2", "woff2" },
+};
+
+static inline unsigned char fold(unsigned char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static uint32_t hash_ext(const char *ext, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ fold(ext[i])) * 16777619u;
+    return h;
+}
+
+/* Compare 'ext' of length 'len', in any case, against a folded key. */
+static bool ext_equals(const char *key, const char *ext, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (key[i] != fold(ext[i]))
+            return false;
+    }
+    return key[len] == '\0';
+}
+
+static void grow(void)
+{
+    unsigned old_size = table != NULL ? mask + 1 : 0;
+    unsigned size = old_size > 0 ? 2 * old_size : 256;
+    struct slot *old = table;
+    table = calloc(size, sizeof(*table));
+    if (table == NULL)
+    {
+        perror("can't alloc memory: ");
+        exit(EXIT_FAILURE);
+    }
+    mask = size - 1;
+    for (unsigned i = 0; i < old_size; i++)
+    {
+        if (old[i].type == NULL)
+            continue;
+        unsigned j = old[i].hash & mask;
+        while (table[j].type != NULL)
+            j = (j + 1) & mask;
+        table[j] = old[i];
+    }
+    free(old);
+}
+
+/* Map an extension to a type, unless it is mapped already. */
+static void insert(const char *ext, size_t len, const struct mime_type *type)
+{
+    if (len == 0 || len >= EXT_MAX)
+        return;
+    // keep the load factor at most one half, so that probe sequences stay short
+    if (table == NULL || 2 * (nused + 1) > mask + 1)
+        grow();
+
+    uint32_t hash = hash_ext(ext, len);
+    unsigned i = hash & mask;
+    for (; table[i].type != NULL; i = (i + 1) & mask)
+    {
+        if (table[i].hash == hash && ext_equals(table[i].ext, ext, len))
+            return;
+    }
+    table[i].hash = hash;
+    for (size_t k = 0; k < len; k++)
+        table[i].ext[k] = fold(ext[k]);
+    table[i].ext[len] = '\0';
+    table[i].type = type;
+    nused++;
+}
+
+/* Whether a type is text-like: any text type, JavaScript, or JSON or XML,
+ * either as the subtype (application/json) or as its structured
+ * syntax suffix (image/svg+xml).  Types like the OOXML formats
+ * merely mention xml and are zip archives, already compressed. */
+static bool is_compressible(const char *name)
+{
+    const char *subtype = strchr(name, '/');
+    if (subtype == NULL)
+        return false;
+    subtype++;
+    const char *suffix = strrchr(subtype, '+');
+    return !strncmp(name, "text/", 5) || strstr(subtype, "javascript") != NULL
+           || !strcmp(subtype, "json") || !strcmp(subtype, "xml")
+           || (suffix != NULL && (!strcmp(suffix, "+json") || !strcmp(suffix, "+xml")));
+}
+
+static struct mime_type *new_type(const char *name)
+{
+    size_t name_len = strlen(name);
+    size_t header_len = strlen("Content-Type: \r\n") + name_len;
+    struct mime_type *type = malloc(sizeof(*type) + name_len + 1 + header_len + 1);
+    if (type == NULL)
+    {
+        perror("can't alloc memory: ");
+        exit(EXIT_FAILURE);
+    }
+    char *p = (char *) (type + 1);
+    type->name = memcpy(p, name, name_len + 1);
+    p += name_len + 1;
+    snprintf(p, header_len + 1, "Content-Type: %s\r\n", name);
+    type->header = p;
+    type->header_len = header_len;
+    type->compressible = is_compressible(name);
+    return type;
+}
+
+/* Add a type and its whitespace-separated extensions. */
+static void add_type(const char *name, char *extensions)
+{
+    struct mime_type *type = NULL;
+    char *save;
+    for (char *ext = strtok_r(extensions, " \t\r\n", &save); ext != NULL;
+         ext = strtok_r(NULL, " \t\r\n", &save))
+    {
+        if (type == NULL)
+            type = new_type(name);
+        insert(ext, strlen(ext), type);
+    }
+}
+
+/**
+ * Build the table.  Call once, before any lookup.
+ * @param path A mime.types file to read, or NULL for the built-in types only
+ * @return 0, or -1 with errno set if the file could not be read, in
+ *         which case only the built-in types are known
+ */
+int mimetypes_load(const char *path)
+{
+    int rc = 0;
+    FILE *f = path != NULL ? fopen(path, "r") : NULL;
+    if (path != NULL && f == NULL)
+        rc = -1;
+
+    char *line = NULL;
+    size_t cap = 0;
+    while (f != NULL && getline(&line, &cap, f) != -1)
+    {
+        line[strcspn(line, "#")] = '\0';
+        char *name = line + strspn(line, " \t");
+        size_t name_len = strcspn(name, " \t\r\n");
+        if (name_len == 0 || memchr(name, '/', name_len) == NULL)
+            continue;
+        char *extensions = name + name_len;
+        if (*extensions != '\0')
+            *extensions++ = '\0';
+        add_type(name, extensions);
+    }
+    if (f != NULL)
+    {
+        if (ferror(f))
+            rc = -1;
+        fclose(f);
+    }
+    free(line);
+
+    for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++)
+    {
+        char extensions[64];
+        snprintf(extensions, sizeof extensions, "%s", builtin[i][1]);
+        add_type(builtin[i][0], extensions);
+    }
+    return rc;
+}
+
+/**
+ * Find the Content-Type of a file.
+ * @param filename The file's name or path
+ * @return Its type, by extension, or application/octet-stream if the
+ *         extension is unknown or missing
+ */
+const struct mime_type *mimetypes_lookup(const char *filename)
+{
+    const char *suffix = strrchr(filename, '.');
+    if (suffix == NULL || strchr(suffix, '/') != NULL || table == NULL)
+        return &octet_stream;
+
+    const char *ext = suffix + 1;
+    size_t len = strlen(ext);
+    if (len == 0 || len >= EXT_MAX)
+        return &octet_stream;
+
+    uint32_t hash = hash_ext(ext, len);
+    for (unsigned i = hash & mask; table[i].type != NULL; i = (i + 1) & mask)
+    {
+        if (table[i].hash == hash && ext_equals(table[i].ext, ext, len))
+            return table[i].type;
+    }
+    return &octet_stream;
+}
@@ -0,0 +1,18 @@
+#ifndef _MIMETYPES_H
+#define _MIMETYPES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A Content-Type, shared by all extensions that map to it. */
+struct mime_type {
+    const char *name;               // e.g. "text/html"
+    const char *header;             // "Content-Type: text/html\r\n"
+    size_t header_len;
+    bool compressible;              // text-like, worth compressing
+};
+
+int mimetypes_load(const char *path);
+const struct mime_type *mimetypes_lookup(const char *filename);
+
+#endif /* _MIMETYPES_H */
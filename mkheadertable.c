@@ -0,0 +1,63 @@
+/*
+ * Generates http_header_table.h, a perfect hash table over the header
+ * names in http_headers.h.
+ *
+ * It searches for the smallest power-of-two table size and a seed for
+ * http_header_hash() under which no two names collide, and prints the
+ * table mapping each slot to its header, or HTTP_HEADER_OTHER.
+ *
+ * Usage: ./mkheadertable > http_header_table.h
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http_headers.h"
+
+#define HTTP_HEADER_NAME(id, name) name,
+static const char *names[] = { HTTP_HEADER_LIST(HTTP_HEADER_NAME) };
+
+#define MAX_TABLE_SIZE 1024
+#define MAX_SEED 1000000
+
+static bool try_seed(uint32_t seed, uint32_t size, int *table)
+{
+    for (uint32_t i = 0; i < size; i++)
+        table[i] = HTTP_HEADER_OTHER;
+    for (int id = 0; id < HTTP_HEADER_COUNT; id++)
+    {
+        uint32_t slot = http_header_hash(names[id], strlen(names[id]), seed) & (size - 1);
+        if (table[slot] != HTTP_HEADER_OTHER)
+            return false;
+        table[slot] = id;
+    }
+    return true;
+}
+
+int main(void)
+{
+    static int table[MAX_TABLE_SIZE];
+
+    for (uint32_t size = 16; size <= MAX_TABLE_SIZE; size *= 2)
+    {
+        if (size < HTTP_HEADER_COUNT)
+            continue;
+        for (uint32_t seed = 3; seed < MAX_SEED; seed += 2)
+        {
+            if (!try_seed(seed, size, table))
+                continue;
+
+            printf("/* Generated by mkheadertable from http_headers.h; do not edit. */\n");
+            printf("#define HTTP_HEADER_HASH_SEED %uu\n", seed);
+            printf("#define HTTP_HEADER_TABLE_SIZE %u\n\n", size);
+            printf("static const signed char header_table[HTTP_HEADER_TABLE_SIZE] = {\n");
+            for (uint32_t i = 0; i < size; i++)
+                printf("%s%3d,%s", i % 8 == 0 ? "   " : "", table[i], (i + 1) % 8 == 0 ? "\n" : "");
+            printf("};\n");
+            return EXIT_SUCCESS;
+        }
+    }
+    fprintf(stderr, "mkheadertable: no collision-free seed found\n");
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,208 @@
+/*
+ * Scanning kernels for the request parser.
+ *
+ * Most bytes of a request head are in the middle of a path, a header
+ * name or a header value, where the parser's state does not change.
+ * These kernels skip such runs 16 (SSE2) or 32 (AVX2) bytes at a time:
+ * they compute a mask of "stop" bytes with a few compares, and return
+ * the position of the first one.  The scalar versions are used when
+ * the CPU has no suitable vector unit and for the tails of the input.
+ *
+ * The implementation is chosen once, at run time, by scan_init().
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+static inline bool path_stop(unsigned char c)
+{
+    return c <= ' ' || c == 0x7f;
+}
+
+static inline bool value_stop(unsigned char c)
+{
+    return (c < ' ' && c != '\t') || c == 0x7f;
+}
+
+static inline bool name_stop(unsigned char c)
+{
+    unsigned char l = c | 0x20;
+    return !((l >= 'a' && l <= 'z') || (c >= '0' && c <= '9') || c == '-');
+}
+
+#define SCALAR_KERNEL(name, stop)                           \
+static size_t name(const char *data, size_t len)            \
+{                                                           \
+    size_t i = 0;                                           \
+    while (i < len && !stop((unsigned char) data[i]))       \
+        i++;                                                \
+    return i;                                               \
+}
+
+SCALAR_KERNEL(scan_path_scalar, path_stop)
+SCALAR_KERNEL(scan_value_scalar, value_stop)
+SCALAR_KERNEL(scan_name_scalar, name_stop)
+
+#ifdef HAVE_X86_SIMD
+/*
+ * SSE2 and AVX2 have only signed byte compares; an unsigned x <= k is
+ * computed as min(x, k) == x.
+ */
+#define SSE_LE(x, k)  _mm_cmpeq_epi8(_mm_min_epu8((x), _mm_set1_epi8(k)), (x))
+#define SSE_EQ(x, k)  _mm_cmpeq_epi8((x), _mm_set1_epi8(k))
+
+static inline __m128i path_mask_sse2(__m128i x)
+{
+    return _mm_or_si128(SSE_LE(x, ' '), SSE_EQ(x, 0x7f));
+}
+
+static inline __m128i value_mask_sse2(__m128i x)
+{
+    __m128i ctl = _mm_andnot_si128(SSE_EQ(x, '\t'), SSE_LE(x, ' ' - 1));
+    return _mm_or_si128(ctl, SSE_EQ(x, 0x7f));
+}
+
+static inline __m128i name_mask_sse2(__m128i x)
+{
+    __m128i l = _mm_sub_epi8(_mm_or_si128(x, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8('0'));
+    __m128i ok = _mm_or_si128(_mm_or_si128(SSE_LE(l, 'z' - 'a'), SSE_LE(d, 9)), SSE_EQ(x, '-'));
+    return _mm_xor_si128(ok, _mm_set1_epi8(-1));
+}
+
+#define SSE2_KERNEL(name, mask, scalar)                                 \
+static size_t name(const char *data, size_t len)                        \
+{                                                                       \
+    size_t i = 0;                                                       \
+    for (; i + 16 <= len; i += 16)                                      \
+    {                                                                   \
+        __m128i x = _mm_loadu_si128((const __m128i *) (data + i));     \
+        unsigned m = _mm_movemask_epi8(mask(x));                        \
+        if (m)                                                          \
+            return i + __builtin_ctz(m);                                \
+    }                                                                   \
+    return i + scalar(data + i, len - i);                               \
+}
+
+SSE2_KERNEL(scan_path_sse2, path_mask_sse2, scan_path_scalar)
+SSE2_KERNEL(scan_value_sse2, value_mask_sse2, scan_value_scalar)
+SSE2_KERNEL(scan_name_sse2, name_mask_sse2, scan_name_scalar)
+
+#define AVX_LE(x, k)  _mm256_cmpeq_epi8(_mm256_min_epu8((x), _mm256_set1_epi8(k)), (x))
+#define AVX_EQ(x, k)  _mm256_cmpeq_epi8((x), _mm256_set1_epi8(k))
+#define AVX2 __attribute__((target("avx2")))
+
+/*
+ * The tail of the input is left to the SSE2 kernel.  That one is not
+ * VEX-encoded, so the upper halves of the ymm registers must be cleared
+ * before calling it, or every call pays an AVX-SSE transition penalty.
+ */
+
+static inline AVX2 __m256i path_mask_avx2(__m256i x)
+{
+    return _mm256_or_si256(AVX_LE(x, ' '), AVX_EQ(x, 0x7f));
+}
+
+static inline AVX2 __m256i value_mask_avx2(__m256i x)
+{
+    __m256i ctl = _mm256_andnot_si256(AVX_EQ(x, '\t'), AVX_LE(x, ' ' - 1));
+    return _mm256_or_si256(ctl, AVX_EQ(x, 0x7f));
+}
+
+static inline AVX2 __m256i name_mask_avx2(__m256i x)
+{
+    __m256i l = _mm256_sub_epi8(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8('0'));
+    __m256i ok = _mm256_or_si256(_mm256_or_si256(AVX_LE(l, 'z' - 'a'), AVX_LE(d, 9)), AVX_EQ(x, '-'));
+    return _mm256_xor_si256(ok, _mm256_set1_epi8(-1));
+}
+
+#define AVX2_KERNEL(name, mask, sse2)                                   \
+static AVX2 size_t name(const char *data, size_t len)                   \
+{                                                                       \
+    size_t i = 0;                                                       \
+    for (; i + 32 <= len; i += 32)                                      \
+    {                                                                   \
+        __m256i x = _mm256_loadu_si256((const __m256i *) (data + i));  \
+        unsigned m = _mm256_movemask_epi8(mask(x));                     \
+        if (m)                                                          \
+            return i + __builtin_ctz(m);                                \
+    }                                                                   \
+    _mm256_zeroupper();                                                 \
+    return i + sse2(data + i, len - i);                                 \
+}
+
+AVX2_KERNEL(scan_path_avx2, path_mask_avx2, scan_path_sse2)
+AVX2_KERNEL(scan_value_avx2, value_mask_avx2, scan_value_sse2)
+AVX2_KERNEL(scan_name_avx2, name_mask_avx2, scan_name_sse2)
+#endif /* HAVE_X86_SIMD */
+
+static const struct scan_impl {
+    const char *name;
+    size_t (*path)(const char *, size_t);
+    size_t (*value)(const char *, size_t);
+    size_t (*name_)(const char *, size_t);
+} impls[] = {
+#ifdef HAVE_X86_SIMD
+    { "avx2", scan_path_avx2, scan_value_avx2, scan_name_avx2 },
+    { "sse2", scan_path_sse2, scan_value_sse2, scan_name_sse2 },
+#endif
+    { "table", scan_path_scalar, scan_value_scalar, scan_name_scalar },
+};
+
+static const struct scan_impl *current = &impls[sizeof(impls) / sizeof(impls[0]) - 1];
+
+size_t (*scan_path)(const char *, size_t) = scan_path_scalar;
+size_t (*scan_value)(const char *, size_t) = scan_value_scalar;
+size_t (*scan_name)(const char *, size_t) = scan_name_scalar;
+
+static bool supported(const struct scan_impl *impl)
+{
+#ifdef HAVE_X86_SIMD
+    if (!strcmp(impl->name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(impl->name, "sse2"))
+        return __builtin_cpu_supports("sse2");
+#endif
+    return true;
+}
+
+/**
+ * Use the given implementation of the kernels.
+ * @param impl "avx2", "sse2" or "table", the parser's plain table walk
+ * @return false if it is unknown or not supported by this CPU
+ */
+bool scan_select(const char *impl)
+{
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+    {
+        if (strcmp(impls[i].name, impl) || !supported(&impls[i]))
+            continue;
+        current = &impls[i];
+        scan_path = impls[i].path;
+        scan_value = impls[i].value;
+        scan_name = impls[i].name_;
+        return true;
+    }
+    return false;
+}
+
+/* Name of the implementation in use. */
+const char *scan_impl(void)
+{
+    return current->name;
+}
+
+/* Pick the best implementation this CPU supports. */
+void scan_init(void)
+{
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+        if (scan_select(impls[i].name))
+            return;
+}
@@ -0,0 +1,27 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Vectorized scanning kernels for the request parser.  Each returns the
+ * number of leading bytes of data[0..len) that cannot end the token
+ * being scanned, i.e., the index of the first byte the parser has to
+ * look at, or len if there is none.  The kernels are conservative: they
+ * may stop early at a byte that turns out to be harmless, but never skip
+ * one that matters.
+ */
+
+/* Request target: stops at SP, CTL (including CR, LF) and DEL. */
+extern size_t (*scan_path)(const char *data, size_t len);
+/* Header value: stops at CTL other than HT (including CR, LF) and DEL. */
+extern size_t (*scan_value)(const char *data, size_t len);
+/* Header name: stops at anything but letters, digits and '-'. */
+extern size_t (*scan_name)(const char *data, size_t len);
+
+void scan_init(void);
+bool scan_select(const char *impl);
+const char *scan_impl(void);
+
+#endif /* _SCAN_H */
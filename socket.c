@@ -8,6 +8,8 @@
  * Written by G. Back for CS 3214 Spring 2018.
  */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
@@ -20,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdbool.h>
 
 #include "socket.h"
 #include "globals.h"
@@ -27,6 +30,8 @@
 /*
  * Find a suitable IPv4 address to bind to, create a socket, bind it,
  * invoke listen to get the socket ready for accepting clients.
+ * If 'reuseport' is set, SO_REUSEPORT is enabled so that several
+ * sockets can be bound to the same port.
  *
  * This function does not implement proper support for protocol-independent/
  * dual-stack binding.  Adding this is part of the assignment.
@@ -34,8 +39,8 @@
  * Returns -1 on error, setting errno.
  * Returns socket file descriptor otherwise.
  */
-int
-socket_open_bind_listen(char * port_number_string, int backlog)
+static int
+open_bind_listen(char * port_number_string, int backlog, bool reuseport)
 {
     struct addrinfo *info, *pinfo;
     struct addrinfo hint;
@@ -88,6 +93,12 @@ socket_open_bind_listen(char * port_number_string, int backlog)
         // See https://stackoverflow.com/a/3233022 for a good explanation of what this does
         int opt = 1;
         setsockopt (s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof (opt));
+        if (reuseport && setsockopt (s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof (opt)) == -1)
+        {
+            perror("setsockopt SO_REUSEPORT");
+            close(s);
+            return -1;
+        }
 
         rc = bind(s, pinfo->ai_addr, pinfo->ai_addrlen);
         if (rc == -1)
@@ -112,6 +123,40 @@ socket_open_bind_listen(char * port_number_string, int backlog)
     return -1;
 }
 
+/*
+ * Open a single listening socket.  See open_bind_listen.
+ */
+int
+socket_open_bind_listen(char * port_number_string, int backlog)
+{
+    return open_bind_listen(port_number_string, backlog, false);
+}
+
+/*
+ * Open 'nshards' listening sockets bound to the same port with
+ * SO_REUSEPORT, storing them in sockets[0..nshards-1].  The kernel
+ * then spreads incoming connections across the sockets, so each can
+ * be served by its own accept loop without a shared accept queue.
+ *
+ * Returns -1 on error, in which case no socket is left open.
+ * Returns 0 otherwise.
+ */
+int
+socket_open_bind_listen_shards(char * port_number_string, int backlog, int *sockets, int nshards)
+{
+    for (int i = 0; i < nshards; i++)
+    {
+        sockets[i] = open_bind_listen(port_number_string, backlog, true);
+        if (sockets[i] == -1)
+        {
+            while (i-- > 0)
+                close(sockets[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 /**
  * Accept a client, blocking if necessary.
  *
@@ -119,6 +164,18 @@ socket_open_bind_listen(char * port_number_string, int backlog)
  * -1 on error.
  */
 int socket_accept_client(int accepting_socket)
+{
+    return socket_accept_client_flags(accepting_socket, 0);
+}
+
+/**
+ * Accept a client, passing 'flags' (e.g., SOCK_NONBLOCK) to accept4(2).
+ *
+ * Returns file descriptor of client accepted on success, returns
+ * -1 on error.  If the accepting socket is non-blocking and no client
+ * is pending, returns -1 with errno set to EAGAIN without reporting it.
+ */
+int socket_accept_client_flags(int accepting_socket, int flags)
 {
     /* The address passed into accept must be large enough for either IPv4 & IPv6.
      * Using a struct sockaddr is too small to hold a full IPv6 address and accept()
@@ -127,10 +184,11 @@ int socket_accept_client(int accepting_socket)
     struct sockaddr_storage peer;
     socklen_t peersize = sizeof(peer);
 
-    int client = accept(accepting_socket, (struct sockaddr *) &peer, &peersize);
+    int client = accept4(accepting_socket, (struct sockaddr *) &peer, &peersize, flags);
     if (client == -1)
     {
-        perror("accept");
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("accept");
         return -1;
     }
 
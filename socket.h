@@ -2,6 +2,8 @@
 #define _SOCKET_H
 
 int socket_open_bind_listen(char * port_number_string, int backlog);
+int socket_open_bind_listen_shards(char * port_number_string, int backlog, int *sockets, int nshards);
 int socket_accept_client(int socket);
+int socket_accept_client_flags(int socket, int flags);
 
 #endif /* _SOCKET_H */
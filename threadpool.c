@@ -0,0 +1,266 @@
+/*
+ * A fixed-size pool of worker threads serving accepted client sockets.
+ *
+ * Workers are spawned once at startup so that thread creation is not
+ * part of connection setup, and their number bounds how many connections
+ * are served concurrently.  Each worker owns a run queue (a deque of
+ * client sockets).  The acceptor distributes new sockets round-robin
+ * across the run queues; a worker takes work from the head of its own
+ * queue and, once that is empty, steals from the tail of the other
+ * workers' queues before going to sleep.
+ *
+ * Each deque is protected by its own lock, so the acceptor and a worker
+ * only contend on the queue they touch.  A worker that finds no work
+ * after a few attempts parks on a condition of its own.  The acceptor
+ * wakes the worker it queued to if that one is parked, or else any
+ * parked worker, which then steals the socket.  There is no pool-wide
+ * lock.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "threadpool.h"
+
+struct runqueue
+{
+    pthread_mutex_t lock;
+    int *items;         // circular array of client sockets
+    int cap;            // allocated slots, always a power of 2
+    int head;           // index of the oldest item
+    int len;            // number of queued items
+};
+
+struct worker
+{
+    pthread_t thread;
+    struct threadpool *pool;
+    int id;
+    pthread_mutex_t park_lock;
+    pthread_cond_t park_cond;
+    atomic_bool parked;     // set under park_lock, cleared by whoever wakes it
+};
+
+struct threadpool
+{
+    int nworkers;
+    struct runqueue *queues;
+    struct worker *workers;
+    void (*handler)(int);
+    atomic_uint next;   // round-robin position for submissions
+};
+
+static const int RUNQUEUE_INITIAL_CAP = 64;
+static const int STEAL_ATTEMPTS = 4;    // rounds of find_work before parking
+
+static void runqueue_init(struct runqueue *rq)
+{
+    pthread_mutex_init(&rq->lock, NULL);
+    rq->cap = RUNQUEUE_INITIAL_CAP;
+    rq->items = malloc(rq->cap * sizeof(*rq->items));
+    if (rq->items == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    rq->head = 0;
+    rq->len = 0;
+}
+
+/* Append a socket at the tail of the run queue, growing it if full. */
+static void runqueue_push(struct runqueue *rq, int sock)
+{
+    pthread_mutex_lock(&rq->lock);
+    if (rq->len == rq->cap)
+    {
+        int *items = malloc(2 * rq->cap * sizeof(*items));
+        if (items == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < rq->len; i++)
+            items[i] = rq->items[(rq->head + i) & (rq->cap - 1)];
+        free(rq->items);
+        rq->items = items;
+        rq->cap *= 2;
+        rq->head = 0;
+    }
+    rq->items[(rq->head + rq->len) & (rq->cap - 1)] = sock;
+    rq->len++;
+    pthread_mutex_unlock(&rq->lock);
+}
+
+/* Take the oldest socket from the head; used by the owning worker. */
+static int runqueue_pop(struct runqueue *rq)
+{
+    int sock = -1;
+    pthread_mutex_lock(&rq->lock);
+    if (rq->len > 0)
+    {
+        sock = rq->items[rq->head];
+        rq->head = (rq->head + 1) & (rq->cap - 1);
+        rq->len--;
+    }
+    pthread_mutex_unlock(&rq->lock);
+    return sock;
+}
+
+/* Take the newest socket from the tail; used by thieves.  Uses trylock
+ * so a thief never waits on a queue that is busy anyway. */
+static int runqueue_steal(struct runqueue *rq)
+{
+    int sock = -1;
+    if (pthread_mutex_trylock(&rq->lock) != 0)
+        return -1;
+    if (rq->len > 0)
+    {
+        rq->len--;
+        sock = rq->items[(rq->head + rq->len) & (rq->cap - 1)];
+    }
+    pthread_mutex_unlock(&rq->lock);
+    return sock;
+}
+
+/* Find work for worker 'id': its own queue first, then the others'. */
+static int find_work(struct threadpool *pool, int id)
+{
+    int sock = runqueue_pop(&pool->queues[id]);
+    for (int i = 1; sock == -1 && i < pool->nworkers; i++)
+        sock = runqueue_steal(&pool->queues[(id + i) % pool->nworkers]);
+    return sock;
+}
+
+/* Check whether any run queue holds a socket.  Takes every queue's
+ * lock, so it cannot miss a push that completed before it looked. */
+static bool any_queued(struct threadpool *pool)
+{
+    for (int i = 0; i < pool->nworkers; i++)
+    {
+        struct runqueue *rq = &pool->queues[i];
+        pthread_mutex_lock(&rq->lock);
+        int len = rq->len;
+        pthread_mutex_unlock(&rq->lock);
+        if (len > 0)
+            return true;
+    }
+    return false;
+}
+
+/* Sleep until woken by threadpool_submit.  The worker is marked parked
+ * before it checks the queues: a submission either pushed before the
+ * check, which then sees it, or reads the mark after, and wakes it. */
+static void worker_park(struct worker *self)
+{
+    pthread_mutex_lock(&self->park_lock);
+    atomic_store(&self->parked, true);
+    if (any_queued(self->pool))
+        atomic_store(&self->parked, false);
+    while (atomic_load(&self->parked))
+        pthread_cond_wait(&self->park_cond, &self->park_lock);
+    pthread_mutex_unlock(&self->park_lock);
+}
+
+/* Wake 'w' if it is parked.  Returns false if it was not. */
+static bool worker_wake(struct worker *w)
+{
+    if (!atomic_load(&w->parked))
+        return false;
+    pthread_mutex_lock(&w->park_lock);
+    bool woken = atomic_load(&w->parked);
+    if (woken)
+    {
+        atomic_store(&w->parked, false);
+        pthread_cond_signal(&w->park_cond);
+    }
+    pthread_mutex_unlock(&w->park_lock);
+    return woken;
+}
+
+static void *worker_thread(void *args)
+{
+    struct worker *self = args;
+    struct threadpool *pool = self->pool;
+
+    for (;;)
+    {
+        // steals use trylock and may miss a busy queue, so look a few times
+        int sock = find_work(pool, self->id);
+        for (int i = 1; sock == -1 && i < STEAL_ATTEMPTS; i++)
+        {
+            sched_yield();
+            sock = find_work(pool, self->id);
+        }
+        if (sock == -1)
+        {
+            worker_park(self);
+            continue;
+        }
+        pool->handler(sock);
+    }
+    return NULL;
+}
+
+/**
+ * Create a pool of 'nworkers' threads that call 'handler' for each
+ * submitted client socket.  The handler owns the socket and must close it.
+ * @return return the new pool, or NULL if the workers could not be started
+ */
+struct threadpool * threadpool_create(int nworkers, void (*handler)(int))
+{
+    struct threadpool *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+    {
+        perror("calloc");
+        return NULL;
+    }
+    pool->nworkers = nworkers;
+    pool->handler = handler;
+    pool->queues = calloc(nworkers, sizeof(*pool->queues));
+    pool->workers = calloc(nworkers, sizeof(*pool->workers));
+    if (pool->queues == NULL || pool->workers == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nworkers; i++)
+    {
+        runqueue_init(&pool->queues[i]);
+        pthread_mutex_init(&pool->workers[i].park_lock, NULL);
+        pthread_cond_init(&pool->workers[i].park_cond, NULL);
+        atomic_init(&pool->workers[i].parked, false);
+    }
+
+    for (int i = 0; i < nworkers; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_thread, &pool->workers[i]) != 0)
+        {
+            fprintf(stderr, "Create worker thread error!\n");
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/**
+ * Hand an accepted client socket to the pool.
+ * @param pool The pool
+ * @param client_socket The socket to be served
+ */
+void threadpool_submit(struct threadpool *pool, int client_socket)
+{
+    unsigned id = atomic_fetch_add(&pool->next, 1) % pool->nworkers;
+    runqueue_push(&pool->queues[id], client_socket);
+
+    // its owner may be busy serving; then let a parked worker steal it
+    for (int i = 0; i < pool->nworkers; i++)
+    {
+        if (worker_wake(&pool->workers[(id + i) % pool->nworkers]))
+            break;
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+struct threadpool;  // opaque type
+
+struct threadpool * threadpool_create(int nworkers, void (*handler)(int));
+void threadpool_submit(struct threadpool *pool, int client_socket);
+
+#endif /* _THREADPOOL_H */
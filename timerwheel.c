@@ -0,0 +1,173 @@
+/*
+ * A hierarchical timing wheel.
+ *
+ * Level 0 has one slot per tick for timers due within the next
+ * TIMERWHEEL_SLOTS ticks.  Each further level covers TIMERWHEEL_SLOTS
+ * times the range of the one below it, with one slot per full turn of
+ * that lower level.  Whenever a level wraps around, the timers of the
+ * current slot of the next level up are redistributed ("cascaded") into
+ * the lower levels.
+ *
+ * Arming and cancelling are O(1): a timer is linked into, or unlinked
+ * from, a doubly-linked slot list.  This is what makes it cheap to
+ * re-arm a connection's deadline on every state change.
+ *
+ * The wheel is not thread-safe; callers that share one must lock it.
+ */
+#include <stddef.h>
+#include <time.h>
+
+#include "timerwheel.h"
+
+static void list_init(struct timer *head)
+{
+    head->next = head->prev = head;
+}
+
+/**
+ * Initialize an empty wheel
+ * @param tw The wheel
+ * @param now The current tick
+ */
+void timerwheel_init(struct timerwheel *tw, uint64_t now)
+{
+    tw->now = now;
+    for (int l = 0; l < TIMERWHEEL_LEVELS; l++)
+        for (int s = 0; s < TIMERWHEEL_SLOTS; s++)
+            list_init(&tw->slots[l][s]);
+}
+
+/**
+ * Initialize an unarmed timer
+ * @param t The timer
+ * @param fn The function called when the timer fires
+ */
+void timer_init(struct timer *t, void (*fn)(struct timer *))
+{
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+}
+
+/* Return true if the timer is armed. */
+bool timer_armed(struct timer *t)
+{
+    return t->next != NULL;
+}
+
+/* Link a timer into the slot that corresponds to its expiry tick. */
+static void insert(struct timerwheel *tw, struct timer *t)
+{
+    uint64_t expires = t->expires > tw->now ? t->expires : tw->now + 1;
+    uint64_t delta = expires - tw->now;
+    int level = 0;
+
+    while (level < TIMERWHEEL_LEVELS - 1
+           && delta >= (uint64_t)1 << ((level + 1) * TIMERWHEEL_SLOT_BITS))
+        level++;
+
+    // timers beyond the range of the wheel wait in the last slot of the top level
+    uint64_t range = (uint64_t)1 << (TIMERWHEEL_LEVELS * TIMERWHEEL_SLOT_BITS);
+    if (delta >= range)
+        expires = tw->now + range - 1;
+
+    int slot = (expires >> (level * TIMERWHEEL_SLOT_BITS)) & (TIMERWHEEL_SLOTS - 1);
+    struct timer *head = &tw->slots[level][slot];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/**
+ * Arm a timer to fire at tick 'expires', re-arming it if it is armed.
+ * A timer whose tick has already passed fires at the next tick.
+ * @param tw The wheel
+ * @param t The timer
+ * @param expires The tick at which the timer fires
+ */
+void timer_arm(struct timerwheel *tw, struct timer *t, uint64_t expires)
+{
+    timer_cancel(t);
+    t->expires = expires;
+    insert(tw, t);
+}
+
+/**
+ * Disarm a timer.  Has no effect if the timer is not armed.
+ * @param t The timer
+ */
+void timer_cancel(struct timer *t)
+{
+    if (t->next == NULL)
+        return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/* Redistribute the timers of one slot into the lower levels. */
+static void cascade(struct timerwheel *tw, int level, int slot)
+{
+    struct timer *head = &tw->slots[level][slot];
+    struct timer list;
+
+    if (head->next == head)
+        return;
+    // detach the slot's list first, since insert may link into this slot again
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    list_init(head);
+
+    while (list.next != &list)
+    {
+        struct timer *t = list.next;
+        timer_cancel(t);
+        insert(tw, t);
+    }
+}
+
+/**
+ * Advance the wheel to tick 'now', firing every timer that expires
+ * up to and including it.  Timer functions may arm and cancel timers.
+ * @param tw The wheel
+ * @param now The current tick
+ */
+void timerwheel_advance(struct timerwheel *tw, uint64_t now)
+{
+    while (tw->now < now)
+    {
+        tw->now++;
+        int slot = tw->now & (TIMERWHEEL_SLOTS - 1);
+
+        for (int level = 1; level < TIMERWHEEL_LEVELS; level++)
+        {
+            uint64_t lower = tw->now >> ((level - 1) * TIMERWHEEL_SLOT_BITS);
+            if ((lower & (TIMERWHEEL_SLOTS - 1)) != 0)
+                break;
+            cascade(tw, level, (tw->now >> (level * TIMERWHEEL_SLOT_BITS)) & (TIMERWHEEL_SLOTS - 1));
+        }
+
+        struct timer *head = &tw->slots[0][slot];
+        while (head->next != head)
+        {
+            struct timer *t = head->next;
+            timer_cancel(t);
+            if (t->expires > tw->now)
+                insert(tw, t);      // a capped far-future timer; keep waiting
+            else
+                t->fn(t);
+        }
+    }
+}
+
+/* Return the current tick, counted in TIMERWHEEL_TICK_MS units of the
+ * monotonic clock. */
+uint64_t timerwheel_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMERWHEEL_TICK_MS;
+}
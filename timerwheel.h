@@ -0,0 +1,34 @@
+#ifndef _TIMERWHEEL_H
+#define _TIMERWHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIMERWHEEL_LEVELS     4
+#define TIMERWHEEL_SLOT_BITS  6
+#define TIMERWHEEL_SLOTS      (1 << TIMERWHEEL_SLOT_BITS)
+#define TIMERWHEEL_TICK_MS    100
+
+/* A timer, meant to be embedded in the object it times out. */
+struct timer
+{
+    struct timer *next, *prev;  // links in the wheel slot; NULL if not armed
+    uint64_t expires;           // tick at which the timer fires
+    void (*fn)(struct timer *); // called when the timer fires
+};
+
+struct timerwheel
+{
+    uint64_t now;               // last tick processed
+    struct timer slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];   // list heads
+};
+
+void timerwheel_init(struct timerwheel *tw, uint64_t now);
+void timer_init(struct timer *t, void (*fn)(struct timer *));
+void timer_arm(struct timerwheel *tw, struct timer *t, uint64_t expires);
+void timer_cancel(struct timer *t);
+bool timer_armed(struct timer *t);
+void timerwheel_advance(struct timerwheel *tw, uint64_t now);
+uint64_t timerwheel_clock(void);
+
+#endif /* _TIMERWHEEL_H */
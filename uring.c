@@ -0,0 +1,234 @@
+/*
+ * Minimal io_uring support, used by the optional io_uring I/O backend
+ * (see 'make server-uring').
+ *
+ * Only what the backend needs is provided: ring setup, handing out
+ * SQEs, batched submission, reaping CQEs, and a ring of provided
+ * buffers from which the kernel picks a buffer when a recv completes.
+ * A ring is used by a single thread, so no locking is needed; the
+ * memory barriers below order our accesses against the kernel's.
+ */
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Set up a ring with room for 'entries' submissions.
+ * @return return 0 on success, -1 on error with errno set
+ */
+int uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd == -1)
+        return -1;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = ring->sqe_submitted = *ring->sq_tail;
+
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    uring_exit(ring);
+    return -1;
+}
+
+/* Tear down a ring, including its provided buffers. */
+void uring_exit(struct uring *ring)
+{
+    int saved = errno;
+    if (ring->br != NULL)
+        munmap(ring->br, ring->nbufs * sizeof(struct io_uring_buf));
+    free(ring->bufs);
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    errno = saved;
+}
+
+/**
+ * Return a zeroed SQE to fill in, or NULL if the submission queue is full.
+ * The SQE is passed to the kernel by the next uring_submit_and_wait.
+ */
+struct io_uring_sqe * uring_get_sqe(struct uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries)
+        return NULL;
+
+    unsigned idx = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+/**
+ * Submit all SQEs handed out since the last call with a single system
+ * call, and wait until at least 'wait_nr' completions are available.
+ * @return return the number of SQEs submitted, or -1 on error
+ */
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr)
+{
+    unsigned to_submit = ring->sqe_tail - ring->sqe_submitted;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    ring->sqe_submitted = ring->sqe_tail;
+
+    for (;;)
+    {
+        int rc = sys_io_uring_enter(ring->fd, to_submit, wait_nr,
+                                    wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (rc >= 0)
+            return rc;
+        if (errno != EINTR)
+            return -1;
+        to_submit = 0;      // they were consumed before the interruption
+    }
+}
+
+/* Return the oldest unseen completion, or NULL if there is none. */
+struct io_uring_cqe * uring_peek_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/* Mark the completion returned by uring_peek_cqe as consumed. */
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Register 'nbufs' (a power of 2) buffers of 'bufsize' bytes as buffer
+ * group 'bgid'.  A recv submitted with IOSQE_BUFFER_SELECT then uses one
+ * of them, and reports its id in the completion's flags.
+ * @return return 0 on success, -1 on error
+ */
+int uring_setup_buffers(struct uring *ring, unsigned short bgid, unsigned nbufs, unsigned bufsize)
+{
+    size_t ringsize = nbufs * sizeof(struct io_uring_buf);
+    void *br = mmap(NULL, ringsize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (br == MAP_FAILED)
+        return -1;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (unsigned long)br,
+        .ring_entries = nbufs,
+        .bgid = bgid
+    };
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        munmap(br, ringsize);
+        return -1;
+    }
+
+    ring->br = br;
+    ring->bufs = malloc((size_t)nbufs * bufsize);
+    if (ring->bufs == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    ring->nbufs = nbufs;
+    ring->bufsize = bufsize;
+    ring->bgid = bgid;
+    ring->br->tail = 0;
+    for (unsigned bid = 0; bid < nbufs; bid++)
+        uring_recycle_buffer(ring, bid);
+    return 0;
+}
+
+/* Return the memory of provided buffer 'bid'. */
+char * uring_buffer(struct uring *ring, unsigned bid)
+{
+    return ring->bufs + (size_t)bid * ring->bufsize;
+}
+
+/* Give provided buffer 'bid' back to the kernel after its data was consumed. */
+void uring_recycle_buffer(struct uring *ring, unsigned bid)
+{
+    unsigned short tail = ring->br->tail;
+    struct io_uring_buf *buf = &ring->br->bufs[tail & (ring->nbufs - 1)];
+    buf->addr = (unsigned long)uring_buffer(ring, bid);
+    buf->len = ring->bufsize;
+    buf->bid = bid;
+    __atomic_store_n(&ring->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
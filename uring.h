@@ -0,0 +1,46 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdbool.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring wrapper built directly on the system calls,
+ * so that the server does not depend on liburing.
+ */
+struct uring
+{
+    int fd;
+
+    /* submission queue */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;          // local tail of SQEs handed out
+    unsigned sqe_submitted;     // SQEs already passed to the kernel
+
+    /* completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    /* provided buffers for recv */
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned nbufs, bufsize;
+    unsigned short bgid;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+struct io_uring_sqe * uring_get_sqe(struct uring *ring);
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr);
+struct io_uring_cqe * uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+int uring_setup_buffers(struct uring *ring, unsigned short bgid, unsigned nbufs, unsigned bufsize);
+char * uring_buffer(struct uring *ring, unsigned bid);
+void uring_recycle_buffer(struct uring *ring, unsigned bid);
+
+#endif /* _URING_H */
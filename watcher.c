@@ -0,0 +1,204 @@
+/*
+ * Watch the server root for changes to the files it serves.
+ *
+ * A background thread puts an inotify watch on every directory below
+ * the root and reports each file that is modified, has its attributes
+ * changed, or is moved, replaced or deleted to the file cache, which
+ * drops its entry, including entries for failed lookups of files that
+ * are created.  Directories that appear are watched as they do.
+ * A directory that is moved or removed could take any number of cached
+ * paths with it, as could events lost to a full inotify queue, so then
+ * the cache checks all its entries again.
+ *
+ * While all directories are watched, the cache uses no TTL.  If the
+ * watches run out (fs.inotify.max_user_watches), it goes back to
+ * checking files every 'ttl' seconds.  Symbolic links to directories
+ * are not followed; files reached through them are checked by TTL.
+ */
+#define _GNU_SOURCE
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "filecache.h"
+#include "watcher.h"
+
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+                      | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+static int inotify_fd;
+static char **dirs;                 // request path, with a trailing slash, of each watch
+static int ndirs;
+static bool covered = true;         // whether every directory is watched
+
+/* Remember the directory a watch descriptor stands for. */
+static void set_dir(int wd, const char *dir)
+{
+    if (wd >= ndirs)
+    {
+        int n = wd < 2 * ndirs ? 2 * ndirs : wd + 64;
+        char **grown = realloc(dirs, n * sizeof(*dirs));
+        if (grown == NULL)
+        {
+            perror("can't alloc memory: ");
+            exit(EXIT_FAILURE);
+        }
+        memset(grown + ndirs, 0, (n - ndirs) * sizeof(*dirs));
+        dirs = grown;
+        ndirs = n;
+    }
+    free(dirs[wd]);
+    dirs[wd] = strdup(dir);
+}
+
+/* Watch the directory with request path 'dir', ending in a slash, and
+ * everything below it.  Returns false if a watch could not be added
+ * for lack of watches or memory. */
+static bool add_tree(const char *dir)
+{
+    char abs[PATH_MAX];
+    if (snprintf(abs, sizeof abs, "%s%s", server_root, dir) >= sizeof abs)
+        return true;            // no request can name anything in it
+    int wd = inotify_add_watch(inotify_fd, abs, WATCH_EVENTS);
+    if (wd == -1)
+        return errno != ENOSPC && errno != ENOMEM;      // else it vanished or is not a directory
+    set_dir(wd, dir);
+
+    DIR *d = opendir(abs);
+    if (d == NULL)
+        return true;
+    bool ok = true;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        bool is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            is_dir = fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                     && S_ISDIR(st.st_mode);
+        }
+        char sub[PATH_MAX];
+        if (is_dir && snprintf(sub, sizeof sub, "%s%s/", dir, de->d_name) < sizeof sub)
+            ok &= add_tree(sub);
+    }
+    closedir(d);
+    return ok;
+}
+
+/* Fall back to the TTL once a directory goes unwatched. */
+static void check_coverage(bool ok)
+{
+    if (ok || !covered)
+        return;
+    covered = false;
+    filecache_set_watched(false);
+    fprintf(stderr, "out of inotify watches, checking cached files for changes periodically\n");
+}
+
+/* Pass one event on to the file cache. */
+static void handle_event(const struct inotify_event *ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        filecache_invalidate_all();
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= ndirs || dirs[ev->wd] == NULL)
+        return;
+    if (ev->mask & IN_IGNORED)
+    {
+        free(dirs[ev->wd]);
+        dirs[ev->wd] = NULL;
+        return;
+    }
+    if (ev->len == 0)
+        return;
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof path, "%s%s/", dirs[ev->wd], ev->name) >= sizeof path)
+        return;
+    if (ev->mask & IN_ISDIR)
+    {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+            check_coverage(add_tree(path));
+        // a new directory may already hold files that were looked up in vain
+        if (ev->mask & (IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_ATTRIB))
+            filecache_invalidate_all();
+        return;
+    }
+    path[strlen(path) - 1] = '\0';
+    filecache_invalidate(path);
+}
+
+static void *watch(void *arg)
+{
+    check_coverage(add_tree("/"));
+    // files cached before their directory was watched may have changed unseen
+    filecache_invalidate_all();
+    if (covered)
+        filecache_set_watched(true);
+
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;)
+    {
+        ssize_t n = read(inotify_fd, buf, sizeof buf);
+        if (n <= 0)
+        {
+            if (n == -1 && errno == EINTR)
+                continue;
+            perror("inotify read");
+            filecache_set_watched(false);
+            return NULL;
+        }
+        // a write to a file often comes as several events in a row
+        const struct inotify_event *prev = NULL;
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + prev->len)
+        {
+            const struct inotify_event *ev = (const struct inotify_event *) p;
+            bool repeated = prev != NULL && ev->len > 0 && prev->wd == ev->wd && prev->len == ev->len
+                            && !((prev->mask | ev->mask) & IN_ISDIR)
+                            && !memcmp(prev->name, ev->name, ev->len);
+            if (!repeated)
+                handle_event(ev);
+            prev = ev;
+        }
+    }
+}
+
+/**
+ * Start watching the server root for changes, in a thread of its own.
+ * Until all directories are watched, the file cache keeps using its TTL.
+ * @return 0, or -1 if changes cannot be watched
+ */
+int watcher_start(void)
+{
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1)
+    {
+        perror("inotify_init1");
+        return -1;
+    }
+    pthread_t th;
+    if (pthread_create(&th, NULL, watch, NULL) != 0)
+    {
+        fprintf(stderr, "Create thread error!\n");
+        close(inotify_fd);
+        return -1;
+    }
+    pthread_detach(th);
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef _WATCHER_H
+#define _WATCHER_H
+
+int watcher_start(void);
+
+#endif /* _WATCHER_H */